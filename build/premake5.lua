@@ -14,6 +14,18 @@ newoption
     default = "opengl33"
 }
 
+newoption
+{
+    trigger = "fixed-geometry",
+    description = "Specialize the step kernels for the 506x506 room and 20 cell blade"
+}
+
+newoption
+{
+    trigger = "soil-layers",
+    description = "Carry density, moisture and compaction layers with the soil"
+}
+
 function download_progress(total, current)
     local ratio = current / total;
     ratio = math.min(math.max(ratio, 0), 1);
@@ -86,6 +98,20 @@ function platform_defines()
     filter{}
 end
 
+function dsm_defines()
+    -- Envs with other sizes still work, they take the generic path
+    filter {"options:fixed-geometry"}
+        defines {"DSM_FIXED_WIDTH=506", "DSM_FIXED_HEIGHT=506", "DSM_FIXED_BLADE_WIDTH=20", "DSM_FIXED_BLADE_FORE=20"}
+
+    filter {"options:fixed-geometry", "configurations:Release or Release_RGFW"}
+        optimize "Speed"
+
+    filter {"options:soil-layers"}
+        defines {"DSM_SOIL_DENSITY", "DSM_SOIL_MOISTURE", "DSM_SOIL_COMPACTION"}
+
+    filter{}
+end
+
 -- if you don't want to download raylib, then set this to false, and set the raylib dir to where you want raylib to be pulled from, must be full sources.
 downloadRaylib = true
 raylib_dir = "external/raylib-master"
@@ -182,6 +208,7 @@ if (downloadRaylib) then
         includedirs { raylib_dir .."/src/external/glfw/include" }
         flags { "ShadowedVariables"}
         platform_defines()
+        dsm_defines()
 
         filter "action:vs*"
             defines{"_WINSOCK_DEPRECATED_NO_WARNINGS", "_CRT_SECURE_NO_WARNINGS"}
@@ -204,6 +231,28 @@ if (downloadRaylib) then
         filter{}
         
 
+    -- Shared memory env server, see include/dsm_shm.h. POSIX shm and futexes only.
+    if os.istarget("linux") then
+    project "dsm_server"
+        kind "ConsoleApp"
+        location "build_files/"
+        targetdir "../bin/%{cfg.buildcfg}"
+
+        files {"../server/**.c", "../include/**.h"}
+
+        includedirs { "../include" }
+        includedirs {raylib_dir .. "/src" }
+        includedirs {raylib_dir .."/src/external" }
+        includedirs { raylib_dir .."/src/external/glfw/include" }
+
+        links {"raylib", "pthread", "m", "dl", "rt", "X11"}
+
+        cdialect "C17"
+        flags { "ShadowedVariables"}
+        platform_defines()
+        dsm_defines()
+    end
+
     project "raylib"
         kind "StaticLib"
     
@@ -1,8 +1,12 @@
+#pragma once
+
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <assert.h>
 #include <math.h>
+#include <string.h>
+#include <stdint.h>
 #include "raylib.h"
 #include "rlgl.h"
 
@@ -28,6 +32,67 @@
 
 #define TIMESTEP 0.1
 
+// Specialized kernels. Build with DSM_FIXED_WIDTH/HEIGHT (and optionally
+// DSM_FIXED_BLADE_WIDTH/FORE) set to the production geometry and the hot
+// loops get compiled with constant strides and trip counts. Envs that
+// don't match fall back to the runtime-sized path.
+#if defined(_MSC_VER)
+#define DSM_INLINE static __forceinline
+#else
+#define DSM_INLINE static inline __attribute__((always_inline))
+#endif
+
+#if defined(DSM_FIXED_WIDTH) != defined(DSM_FIXED_HEIGHT)
+#error "DSM_FIXED_WIDTH and DSM_FIXED_HEIGHT go together"
+#endif
+#if defined(DSM_FIXED_BLADE_WIDTH) != defined(DSM_FIXED_BLADE_FORE)
+#error "DSM_FIXED_BLADE_WIDTH and DSM_FIXED_BLADE_FORE go together"
+#endif
+
+#define TILE_SIZE 16  // erosion scheduling granularity, in cells
+
+#define TALUS_THRESHOLD 2  // soil only moves down slopes steeper than this
+#define TALUS_REST 1       // slope the multiflow solver leaves behind
+
+// Erosion solvers
+#define SOLVER_STEEPEST 0   // half the steepest difference, stale gradients
+#define SOLVER_MULTIFLOW 1  // excess over the threshold to every downhill neighbour
+
+#define BLADE_SPILL 0.05     // share of the carried soil spilling off the blade's ends per step
+#define BLADE_HALF_LOAD 600  // blade load that halves the travel speed
+
+// Soil property layers. Each one defined (DSM_SOIL_DENSITY, _MOISTURE,
+// _COMPACTION) adds a per-cell array to Env that travels with the soil when
+// the blade or erosion moves it. Layers hold per-volume values and mix by
+// volume. With none defined the height-only path is unchanged.
+#ifdef DSM_SOIL_DENSITY
+#define SOIL_DENSITY 0
+#define SOIL_AFTER_DENSITY 1
+#else
+#define SOIL_AFTER_DENSITY 0
+#endif
+#ifdef DSM_SOIL_MOISTURE
+#define SOIL_MOISTURE SOIL_AFTER_DENSITY
+#define SOIL_AFTER_MOISTURE (SOIL_AFTER_DENSITY + 1)
+#else
+#define SOIL_AFTER_MOISTURE SOIL_AFTER_DENSITY
+#endif
+#ifdef DSM_SOIL_COMPACTION
+#define SOIL_COMPACTION SOIL_AFTER_MOISTURE
+#define DSM_SOIL_LAYERS (SOIL_AFTER_MOISTURE + 1)
+#else
+#define DSM_SOIL_LAYERS SOIL_AFTER_MOISTURE
+#endif
+
+#define SOIL_DEFAULT_DENSITY 1.6     // t/m^3
+#define SOIL_DEFAULT_MOISTURE 0.1    // water mass fraction
+#define SOIL_DEFAULT_COMPACTION 0    // 0 loose, 1 fully compacted
+#define SOIL_ALIGN 64
+
+#if DSM_SOIL_LAYERS > 0 && defined(_WIN32)
+#include <malloc.h>  // _aligned_malloc, neither MSVC nor MinGW has aligned_alloc
+#endif
+
 // ---------------------------------------------------------------
 
 Vector2 rotate(Vector2 vector, float theta)
@@ -56,11 +121,14 @@ struct Agent
   int blade_fore;
   float blade_yaw;
   float blade_height;
+  float blade_load;  // soil carried on the blade, see blade_kernel
 
   float spawn_y;
   float spawn_x;
 };
 
+typedef struct Recorder Recorder;
+
 typedef struct Env Env;
 struct Env
 {
@@ -82,10 +150,112 @@ struct Env
   Agent* agents;
   int action;
 
+  // Erosion only visits awake tiles. A tile sleeps after a pass with no
+  // transfers and wakes when soil moves on or next to it.
+  int tiles_x;
+  int tiles_y;
+  unsigned char* tile_awake;
+  unsigned char* tile_awake_next;
+  unsigned char* tile_dirty;  // heights changed since the recorder's last frame
+
+  int erosion_solver;
+  int settle_sweeps;  // max erosion passes per step, stops early once settled
+  int settle_pass;    // passes run so far, picks the multiflow sweep direction
+  int coarse_factor;  // multiflow only: first coarse grid is this many cells per block, 0 = off
+
+  float* coarse_height;
+  float* coarse_base;
+  unsigned char* coarse_state;
+
+#if DSM_SOIL_LAYERS > 0
+  // One SOIL_ALIGN aligned array per layer, laid out like height_map, and
+  // the block averages erode_coarse moves around
+  float* soil[DSM_SOIL_LAYERS];
+  float* coarse_soil[DSM_SOIL_LAYERS];
+#endif
+
   float max;
   double mean;
+
+  // Blocking cells of grid as bits, see obstacles.h
+  uint64_t* obstacles;
+  int obstacle_words;  // per row
+  int num_obstacles;
+  unsigned char* room_layout;  // cells reset_room() restores, NULL for an empty room
+  int* span_lo;  // footprint rasterization scratch, one per row
+  int* span_hi;
+
+  int tick;
+  Recorder* recorder;  // optional, see recorder.h
 };
 
+void record_reset(Recorder* recorder, Env* env, int seed);
+void record_step(Recorder* recorder, Env* env);
+void sync_obstacles(Env* env);
+bool footprint_blocked(Env* env, Agent* agent, float x0, float y0, float theta0, float x1, float y1, float theta1);
+
+#if DSM_SOIL_LAYERS > 0
+/**
+ * Aligned float array for a soil layer, padded to whole SIMD lines. Free
+ * with free_soil_layer.
+ */
+float* alloc_soil_layer(int count)
+{
+  size_t size = (count*sizeof(float) + SOIL_ALIGN - 1) / SOIL_ALIGN * SOIL_ALIGN;
+#if defined(_WIN32)
+  float* layer = (float*)_aligned_malloc(size, SOIL_ALIGN);
+#else
+  float* layer = (float*)aligned_alloc(SOIL_ALIGN, size);
+#endif
+  memset(layer, 0, size);
+  return layer;
+}
+
+void free_soil_layer(float* layer)
+{
+#if defined(_WIN32)
+  _aligned_free(layer);
+#else
+  free(layer);
+#endif
+}
+#endif
+
+/**
+ * Mix amount of soil with properties src into cell dst of layers, whose
+ * height is dst_height after receiving it. Draining soil from a cell leaves
+ * its per-volume properties alone, so only the receiving side changes.
+ */
+DSM_INLINE void soil_mix(float* const* layers, int dst, const float* src, float amount, float dst_height)
+{
+#if DSM_SOIL_LAYERS > 0
+  if (amount <= 0)
+  {
+    return;
+  }
+  float weight = dst_height > amount ? amount / dst_height : 1;
+  for (int l = 0; l < DSM_SOIL_LAYERS; l++)
+  {
+    layers[l][dst] += (src[l] - layers[l][dst]) * weight;
+  }
+#endif
+}
+
+/**
+ * Move the properties of amount of soil from cell src to cell dst
+ */
+DSM_INLINE void soil_carry(float* const* layers, int src, int dst, float amount, float dst_height)
+{
+#if DSM_SOIL_LAYERS > 0
+  float values[DSM_SOIL_LAYERS];
+  for (int l = 0; l < DSM_SOIL_LAYERS; l++)
+  {
+    values[l] = layers[l][src];
+  }
+  soil_mix(layers, dst, values, amount, dst_height);
+#endif
+}
+
 /**
  * Initialize grid values
  */
@@ -107,6 +277,25 @@ Env* init_grid(
   env->dx_r = (float*)calloc(width*height, sizeof(float));
   env->dy_u = (float*)calloc(width*height, sizeof(float));
   env->dy_d = (float*)calloc(width*height, sizeof(float));
+  env->tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+  env->tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+  env->tile_awake = (unsigned char*)calloc(env->tiles_x*env->tiles_y, sizeof(unsigned char));
+  env->tile_awake_next = (unsigned char*)calloc(env->tiles_x*env->tiles_y, sizeof(unsigned char));
+  env->tile_dirty = (unsigned char*)calloc(env->tiles_x*env->tiles_y, sizeof(unsigned char));
+  env->coarse_height = (float*)calloc((width/2)*(height/2), sizeof(float));
+  env->coarse_base = (float*)calloc((width/2)*(height/2), sizeof(float));
+  env->coarse_state = (unsigned char*)calloc((width/2)*(height/2), sizeof(unsigned char));
+#if DSM_SOIL_LAYERS > 0
+  for (int l = 0; l < DSM_SOIL_LAYERS; l++)
+  {
+    env->soil[l] = alloc_soil_layer(width*height);
+    env->coarse_soil[l] = alloc_soil_layer((width/2)*(height/2));
+  }
+#endif
+  env->obstacle_words = (width + 63) / 64;
+  env->obstacles = (uint64_t*)calloc(height*env->obstacle_words, sizeof(uint64_t));
+  env->span_lo = (int*)calloc(height, sizeof(int));
+  env->span_hi = (int*)calloc(height, sizeof(int));
   env->meters_per_pixel = 0.1;
   env->agents = (Agent*)calloc(num_agents, sizeof(Agent));
   return env;
@@ -136,6 +325,27 @@ void free_env(Env* env)
 {
   free(env->grid);
   free(env->height_map);
+  free(env->dx_l);
+  free(env->dx_r);
+  free(env->dy_u);
+  free(env->dy_d);
+  free(env->tile_awake);
+  free(env->tile_awake_next);
+  free(env->tile_dirty);
+  free(env->coarse_height);
+  free(env->coarse_base);
+  free(env->coarse_state);
+#if DSM_SOIL_LAYERS > 0
+  for (int l = 0; l < DSM_SOIL_LAYERS; l++)
+  {
+    free_soil_layer(env->soil[l]);
+    free_soil_layer(env->coarse_soil[l]);
+  }
+#endif
+  free(env->obstacles);
+  free(env->room_layout);
+  free(env->span_lo);
+  free(env->span_hi);
   free(env->agents);
   free(env);
 }
@@ -163,6 +373,47 @@ int heightgrid_offset(Env* env, int y, int x)
   return y_scaled*env->width + x_scaled;
 }
 
+/**
+ * Mark the tile holding (y, x) awake in tiles, along with any neighbouring
+ * tile whose cells border it, and dirty for the recorder. Everything that
+ * changes a height calls this.
+ */
+void wake_cell(Env* env, unsigned char* tiles, int y, int x)
+{
+  int ty = y / TILE_SIZE;
+  int tx = x / TILE_SIZE;
+  int ry = y - ty*TILE_SIZE;
+  int rx = x - tx*TILE_SIZE;
+
+  tiles[ty*env->tiles_x + tx] = 1;
+  env->tile_dirty[ty*env->tiles_x + tx] = 1;
+  if (ry == 0 && ty > 0)
+  {
+    tiles[(ty-1)*env->tiles_x + tx] = 1;
+  }
+  if (ry == TILE_SIZE-1 && ty < env->tiles_y-1)
+  {
+    tiles[(ty+1)*env->tiles_x + tx] = 1;
+  }
+  if (rx == 0 && tx > 0)
+  {
+    tiles[ty*env->tiles_x + tx-1] = 1;
+  }
+  if (rx == TILE_SIZE-1 && tx < env->tiles_x-1)
+  {
+    tiles[ty*env->tiles_x + tx+1] = 1;
+  }
+}
+
+/**
+ * Wake every tile, for when the whole height map was replaced
+ */
+void wake_all_tiles(Env* env)
+{
+  memset(env->tile_awake, 1, env->tiles_x*env->tiles_y);
+  memset(env->tile_dirty, 1, env->tiles_x*env->tiles_y);
+}
+
 /**
  * Reset env
  */
@@ -177,6 +428,25 @@ void reset(Env* env, int seed)
     }
   }
 
+#ifdef DSM_SOIL_DENSITY
+  for (int i = 0; i < env->width*env->height; i++)
+  {
+    env->soil[SOIL_DENSITY][i] = SOIL_DEFAULT_DENSITY;
+  }
+#endif
+#ifdef DSM_SOIL_MOISTURE
+  for (int i = 0; i < env->width*env->height; i++)
+  {
+    env->soil[SOIL_MOISTURE][i] = SOIL_DEFAULT_MOISTURE;
+  }
+#endif
+#ifdef DSM_SOIL_COMPACTION
+  for (int i = 0; i < env->width*env->height; i++)
+  {
+    env->soil[SOIL_COMPACTION][i] = SOIL_DEFAULT_COMPACTION;
+  }
+#endif
+
   for (int c = 250; c < 300; c++)
   {
     for (int r = 250; r < 300; r++)
@@ -203,10 +473,24 @@ void reset(Env* env, int seed)
     agent->blade_thick = 2;
     agent->blade_fore = 20;
     agent->theta = 110 * PI / 180;
+    agent->blade_load = 0;
+  }
+
+  wake_all_tiles(env);
+  env->settle_pass = 0;
+  sync_obstacles(env);
+
+  env->tick = 0;
+  if (env->recorder)
+  {
+    record_reset(env->recorder, env, seed);
   }
 }
 
-void gradient(Env* env)
+/**
+ * Height map max and mean, for debugging
+ */
+void height_stats(Env* env)
 {
   env->max = 0;
   env->mean = 0;
@@ -216,69 +500,555 @@ void gradient(Env* env)
     for (int c = 1; c < env->width-1; c++)
     {
       int adr = grid_offset(env, r, c);
-      int adr_x_r = grid_offset(env, r, c+1);
-      int adr_y_d = grid_offset(env, r+1, c);
-    
-      env->dx_r[adr] = env->height_map[adr_x_r] - env->height_map[adr];
-      env->dy_d[adr] = env->height_map[adr_y_d] - env->height_map[adr];
-      
       env->mean += env->height_map[adr];
     
       if (env->height_map[adr] > env->max)
       {
         env->max = env->height_map[adr];
       }
-  
     }
   }
   env->mean /= env->width * env->height;
 }
 
-void erode(Env *env)
+/**
+ * Forward differences over the awake tiles, plus a one cell halo above and
+ * to the left that erode() reads for the backward differences
+ */
+DSM_INLINE void gradient_kernel(Env* env, const int width, const int height)
 {
-  for (int r = 1; r < env->height-2; r++)
+  const float* restrict h = env->height_map;
+  float* restrict dx_r = env->dx_r;
+  float* restrict dy_d = env->dy_d;
+
+  for (int ty = 0; ty < env->tiles_y; ty++)
   {
-    for (int c = 1; c < env->width-2; c++)
+    for (int tx = 0; tx < env->tiles_x; tx++)
     {
-      int adr = grid_offset(env, r, c);
-      int adr_dx_l = grid_offset(env, r, c-1);
-      int adr_dy_u = grid_offset(env, r-1, c);
+      if (!env->tile_awake[ty*env->tiles_x + tx])
+      {
+        continue;
+      }
+    
+      int r0 = ty*TILE_SIZE - 1;
+      int r1 = (ty+1)*TILE_SIZE;
+      int c0 = tx*TILE_SIZE - 1;
+      int c1 = (tx+1)*TILE_SIZE;
+      r0 = r0 < 1 ? 1 : r0;
+      c0 = c0 < 1 ? 1 : c0;
+      r1 = r1 > height-1 ? height-1 : r1;
+      c1 = c1 > width-1 ? width-1 : c1;
+    
+      for (int r = r0; r < r1; r++)
+      {
+        for (int c = c0; c < c1; c++)
+        {
+          int adr = r*width + c;
+          int adr_x_r = r*width + c+1;
+          int adr_y_d = (r+1)*width + c;
+        
+          dx_r[adr] = h[adr_x_r] - h[adr];
+          dy_d[adr] = h[adr_y_d] - h[adr];
+        }
+      }
+    }
+  }
+}
+
+void gradient(Env* env)
+{
+#ifdef DSM_FIXED_WIDTH
+  if (env->width == DSM_FIXED_WIDTH && env->height == DSM_FIXED_HEIGHT)
+  {
+    gradient_kernel(env, DSM_FIXED_WIDTH, DSM_FIXED_HEIGHT);
+    return;
+  }
+#endif
+  gradient_kernel(env, env->width, env->height);
+}
+
+/**
+ * One talus pass over the awake tiles. Cells are visited in the same row
+ * major order as a full sweep so results match it exactly. Tiles with no
+ * transfer go to sleep.
+ */
+DSM_INLINE void erode_kernel(Env* env, const int width, const int height)
+{
+  memset(env->tile_awake_next, 0, env->tiles_x*env->tiles_y);
+
+  for (int ty = 0; ty < env->tiles_y; ty++)
+  {
+    int r0 = ty*TILE_SIZE;
+    int r1 = (ty+1)*TILE_SIZE;
+    r0 = r0 < 1 ? 1 : r0;
+    r1 = r1 > height-2 ? height-2 : r1;
+  
+    for (int r = r0; r < r1; r++)
+    {
+      for (int tx = 0; tx < env->tiles_x; tx++)
+      {
+        if (!env->tile_awake[ty*env->tiles_x + tx])
+        {
+          continue;
+        }
+      
+        int c0 = tx*TILE_SIZE;
+        int c1 = (tx+1)*TILE_SIZE;
+        c0 = c0 < 1 ? 1 : c0;
+        c1 = c1 > width-2 ? width-2 : c1;
+      
+        // Gradients are a snapshot, so whether any cell in this run moves
+        // can be decided up front in one branch-free (vectorizable) loop
+        const float* restrict dx = env->dx_r;
+        const float* restrict dy = env->dy_d;
+        int steep = 0;
+        for (int c = c0; c < c1; c++)
+        {
+          int adr = r*width + c;
+          steep += (dx[adr-1] > TALUS_THRESHOLD) + (dx[adr] < -TALUS_THRESHOLD)
+            + (dy[adr-width] > TALUS_THRESHOLD) + (dy[adr] < -TALUS_THRESHOLD);
+        }
+        if (steep == 0)
+        {
+          continue;
+        }
+      
+        for (int c = c0; c < c1; c++)
+        {
+          int adr = r*width + c;
+          int adr_dx_l = r*width + c-1;
+          int adr_dy_u = (r-1)*width + c;
+        
+          float dx_r = env->dx_r[adr];
+          float dx_l = -1*env->dx_r[adr_dx_l];
+          float dy_d = env->dy_d[adr];
+          float dy_u = -1*env->dy_d[adr_dy_u];
+        
+          int adr_x_l = r*width + c-1;
+          int adr_x_r = r*width + c+1;
+          int adr_y_u = (r-1)*width + c;
+          int adr_y_d = (r+1)*width + c;
+        
+          float grads[4] = {dx_l, dx_r, dy_u, dy_d};
+          int adrs[4] = {adr_x_l, adr_x_r, adr_y_u, adr_y_d};
+          int dys[4] = {0, 0, -1, 1};
+          int dxs[4] = {-1, 1, 0, 0};
+        
+          int index = 0;
+          float min = 0;
+        
+          for (int i = 0; i < 4; i++)
+          {
+            if (grads[i] < min)
+            {
+              min = grads[i];
+              index = i;
+            }
+          }
+        
+          if (min < -TALUS_THRESHOLD)
+          {
+            float diff = 0.5 * grads[index];
+            env->height_map[adr] += diff;
+            env->height_map[adrs[index]] -= diff;
+#if DSM_SOIL_LAYERS > 0
+            soil_carry(env->soil, adr, adrs[index], -diff, env->height_map[adrs[index]]);
+#endif
+          
+            wake_cell(env, env->tile_awake_next, r, c);
+            wake_cell(env, env->tile_awake_next, r + dys[index], c + dxs[index]);
+          }
+        }
+      }
+    }
+  }
+
+  unsigned char* swap = env->tile_awake;
+  env->tile_awake = env->tile_awake_next;
+  env->tile_awake_next = swap;
+}
+
+void erode(Env* env)
+{
+#ifdef DSM_FIXED_WIDTH
+  if (env->width == DSM_FIXED_WIDTH && env->height == DSM_FIXED_HEIGHT)
+  {
+    erode_kernel(env, DSM_FIXED_WIDTH, DSM_FIXED_HEIGHT);
+    return;
+  }
+#endif
+  erode_kernel(env, env->width, env->height);
+}
+
+/**
+ * One in-place talus pass with multi-directional outflow. A cell with any
+ * slope over TALUS_THRESHOLD sheds enough to bring its steepest slope down
+ * to TALUS_REST, split between all neighbours below that by how far below
+ * they are. Landing under the threshold rather than on it keeps cells from
+ * trickling forever. Heights are read fresh and successive passes cycle
+ * through all four diagonal sweep orders, so slopes settle in few passes
+ * whichever way they face.
+ */
+DSM_INLINE void erode_multiflow_kernel(Env* env, const int width, const int height, bool reverse_rows, bool reverse_cols)
+{
+  memset(env->tile_awake_next, 0, env->tiles_x*env->tiles_y);
+
+  int row_lo = 1;
+  int row_hi = height-2;
+  int col_lo = 1;
+  int col_hi = width-2;
+  int rows = row_hi - row_lo;
+  int cols = col_hi - col_lo;
+
+  for (int i = 0; i < rows; i++)
+  {
+    int r = reverse_rows ? row_hi-1 - i : row_lo + i;
+    int ty = r / TILE_SIZE;
+  
+    for (int j = 0; j < cols; j++)
+    {
+      int c = reverse_cols ? col_hi-1 - j : col_lo + j;
+      int tx = c / TILE_SIZE;
+    
+      if (!env->tile_awake[ty*env->tiles_x + tx])
+      {
+        // Skip the rest of this tile's row
+        int skip = reverse_cols ? c - tx*TILE_SIZE : (tx+1)*TILE_SIZE-1 - c;
+        j += skip;
+        continue;
+      }
     
-      float dx_r = env->dx_r[adr];
-      float dx_l = -1*env->dx_r[adr_dx_l];
-      float dy_d = env->dy_d[adr];
-      float dy_u = -1*env->dy_d[adr_dy_u];
+      int adr = r*width + c;
+      float h = env->height_map[adr];
     
-      int adr_x_l = grid_offset(env, r, c-1);
-      int adr_x_r = grid_offset(env, r, c+1);
-      int adr_y_u = grid_offset(env, r-1, c);
-      int adr_y_d = grid_offset(env, r+1, c);
+      int adrs[4] = {
+        r*width + c-1,
+        r*width + c+1,
+        (r-1)*width + c,
+        (r+1)*width + c
+      };
+      int dys[4] = {0, 0, -1, 1};
+      int dxs[4] = {-1, 1, 0, 0};
     
-      float grads[4] = {dx_l, dx_r, dy_u, dy_d};
-      int adrs[4] = {adr_x_l, adr_x_r, adr_y_u, adr_y_d};
+      float excess[4];
+      float total = 0;
+      float max = 0;
+      for (int k = 0; k < 4; k++)
+      {
+        float e = h - env->height_map[adrs[k]] - TALUS_REST;
+        excess[k] = e > 0 ? e : 0;
+        total += excess[k];
+        max = excess[k] > max ? excess[k] : max;
+      }
     
-      int index = 0;
-      float min = 0;
+      if (max > TALUS_THRESHOLD - TALUS_REST)
+      {
+        float out = 0.5 * max;
+        env->height_map[adr] -= out;
+        wake_cell(env, env->tile_awake_next, r, c);
+      
+        for (int k = 0; k < 4; k++)
+        {
+          if (excess[k] > 0)
+          {
+            env->height_map[adrs[k]] += out * excess[k] / total;
+#if DSM_SOIL_LAYERS > 0
+            soil_carry(env->soil, adr, adrs[k], out * excess[k] / total, env->height_map[adrs[k]]);
+#endif
+            wake_cell(env, env->tile_awake_next, r + dys[k], c + dxs[k]);
+          }
+        }
+      }
+    }
+  }
+
+  unsigned char* swap = env->tile_awake;
+  env->tile_awake = env->tile_awake_next;
+  env->tile_awake_next = swap;
+}
+
+void erode_multiflow(Env* env, bool reverse_rows, bool reverse_cols)
+{
+#ifdef DSM_FIXED_WIDTH
+  if (env->width == DSM_FIXED_WIDTH && env->height == DSM_FIXED_HEIGHT)
+  {
+    erode_multiflow_kernel(env, DSM_FIXED_WIDTH, DSM_FIXED_HEIGHT, reverse_rows, reverse_cols);
+    return;
+  }
+#endif
+  erode_multiflow_kernel(env, env->width, env->height, reverse_rows, reverse_cols);
+}
+
+#define COARSE_SKIP 0
+#define COARSE_HALO 1
+#define COARSE_ACTIVE 2
+
+/**
+ * coarse_factor is 0 (off) or a power of two up to TILE_SIZE, so every level
+ * settle() visits divides TILE_SIZE
+ */
+bool valid_coarse_factor(int factor)
+{
+  return factor >= 0 && factor <= TILE_SIZE && (factor & (factor - 1)) == 0;
+}
+
+/**
+ * Multiflow passes on block averages of factor x factor cells, with the
+ * threshold scaled to match. Each block's change is added to all of its
+ * cells, so mass is conserved and large scale slopes collapse in a few
+ * cheap passes; the fine passes after it clean up inside the blocks.
+ * factor must divide TILE_SIZE. Only blocks in awake tiles move.
+ */
+void erode_coarse(Env* env, int factor, int passes)
+{
+  int cw = env->width / factor;
+  int ch = env->height / factor;
+  assert(factor >= 2 && valid_coarse_factor(factor));
+  int per_tile = TILE_SIZE / factor;
+
+  // Tiles whose blocks get loaded: awake ones plus their neighbours. The
+  // next-pass wake flags are free until the fine solver clears them.
+  unsigned char* near = env->tile_awake_next;
+  for (int ty = 0; ty < env->tiles_y; ty++)
+  {
+    for (int tx = 0; tx < env->tiles_x; tx++)
+    {
+      int t = ty*env->tiles_x + tx;
+      near[t] = env->tile_awake[t]
+        || (ty > 0 && env->tile_awake[t - env->tiles_x])
+        || (ty < env->tiles_y-1 && env->tile_awake[t + env->tiles_x])
+        || (tx > 0 && env->tile_awake[t-1])
+        || (tx < env->tiles_x-1 && env->tile_awake[t+1]);
+    }
+  }
+
+  memset(env->coarse_state, COARSE_SKIP, cw*ch);
+  for (int ty = 0; ty < env->tiles_y; ty++)
+  {
+    for (int tx = 0; tx < env->tiles_x; tx++)
+    {
+      int t = ty*env->tiles_x + tx;
+      if (!near[t])
+      {
+        continue;
+      }
     
-      for (int i = 0; i < 4; i++)
+      for (int br = ty*per_tile; br < (ty+1)*per_tile && br < ch; br++)
+      {
+        for (int bc = tx*per_tile; bc < (tx+1)*per_tile && bc < cw; bc++)
+        {
+          int r = br*factor;
+          int c = bc*factor;
+          // Blocks must stay inside the fine solver's [1, size-2) interior
+          if (r < 1 || c < 1 || r + factor > env->height-2 || c + factor > env->width-2)
+          {
+            continue;
+          }
+        
+          float sum = 0;
+          for (int y = r; y < r + factor; y++)
+          {
+            for (int x = c; x < c + factor; x++)
+            {
+              sum += env->height_map[grid_offset(env, y, x)];
+            }
+          }
+          int b = br*cw + bc;
+#if DSM_SOIL_LAYERS > 0
+          // Volume weighted block average, a plain one if the block is empty
+          for (int l = 0; l < DSM_SOIL_LAYERS; l++)
+          {
+            float weighted = 0;
+            float plain = 0;
+            for (int y = r; y < r + factor; y++)
+            {
+              for (int x = c; x < c + factor; x++)
+              {
+                int adr = grid_offset(env, y, x);
+                weighted += env->soil[l][adr] * env->height_map[adr];
+                plain += env->soil[l][adr];
+              }
+            }
+            env->coarse_soil[l][b] = sum > 0 ? weighted / sum : plain / (factor*factor);
+          }
+#endif
+          env->coarse_height[b] = sum / (factor*factor);
+          env->coarse_base[b] = env->coarse_height[b];
+          env->coarse_state[b] = env->tile_awake[t] ? COARSE_ACTIVE : COARSE_HALO;
+        }
+      }
+    }
+  }
+
+  float threshold = TALUS_THRESHOLD * factor;
+  float rest = TALUS_REST * factor;
+  for (int pass = 0; pass < passes; pass++)
+  {
+    bool reverse_rows = (env->settle_pass + pass) % 2;
+    bool reverse_cols = ((env->settle_pass + pass) / 2) % 2;
+    bool moved = false;
+  
+    for (int i = 0; i < ch; i++)
+    {
+      int br = reverse_rows ? ch-1 - i : i;
+      int ty = br / per_tile;
+      for (int j = 0; j < cw; j++)
       {
-        if (grads[i] < min)
+        int bc = reverse_cols ? cw-1 - j : j;
+        int tx = bc / per_tile;
+        if (!env->tile_awake[ty*env->tiles_x + tx])
+        {
+          // Skip the rest of this tile's row
+          j += reverse_cols ? bc - tx*per_tile : (tx+1)*per_tile-1 - bc;
+          continue;
+        }
+      
+        int b = br*cw + bc;
+        if (env->coarse_state[b] != COARSE_ACTIVE)
+        {
+          continue;
+        }
+      
+        // Neighbours outside the loaded set act as walls
+        int nbrs[4] = {
+          bc > 0 ? b-1 : -1,
+          bc < cw-1 ? b+1 : -1,
+          br > 0 ? b-cw : -1,
+          br < ch-1 ? b+cw : -1
+        };
+        float excess[4];
+        float total = 0;
+        float max = 0;
+        for (int k = 0; k < 4; k++)
         {
-          min = grads[i];
-          index = i;
+          excess[k] = 0;
+          if (nbrs[k] >= 0 && env->coarse_state[nbrs[k]] != COARSE_SKIP)
+          {
+            float e = env->coarse_height[b] - env->coarse_height[nbrs[k]] - rest;
+            excess[k] = e > 0 ? e : 0;
+          }
+          total += excess[k];
+          max = excess[k] > max ? excess[k] : max;
         }
+      
+        if (max > threshold - rest)
+        {
+          float out = 0.5 * max;
+          env->coarse_height[b] -= out;
+          for (int k = 0; k < 4; k++)
+          {
+            if (excess[k] > 0)
+            {
+              env->coarse_height[nbrs[k]] += out * excess[k] / total;
+#if DSM_SOIL_LAYERS > 0
+              soil_carry(env->coarse_soil, b, nbrs[k], out * excess[k] / total, env->coarse_height[nbrs[k]]);
+#endif
+            }
+          }
+          moved = true;
+        }
+      }
+    }
+  
+    if (!moved)
+    {
+      break;
+    }
+  }
+
+  for (int ty = 0; ty < env->tiles_y; ty++)
+  {
+    for (int tx = 0; tx < env->tiles_x; tx++)
+    {
+      if (!near[ty*env->tiles_x + tx])
+      {
+        continue;
       }
     
-      if (min < -2)
+      for (int br = ty*per_tile; br < (ty+1)*per_tile && br < ch; br++)
       {
-        float diff = 0.5 * grads[index];
-        env->height_map[adr] += diff;
-        env->height_map[adrs[index]] -= diff;
+        for (int bc = tx*per_tile; bc < (tx+1)*per_tile && bc < cw; bc++)
+        {
+          int b = br*cw + bc;
+          float delta = env->coarse_height[b] - env->coarse_base[b];
+          if (env->coarse_state[b] == COARSE_SKIP || delta == 0)
+          {
+            continue;
+          }
+        
+          int r = br*factor;
+          int c = bc*factor;
+#if DSM_SOIL_LAYERS > 0
+          float block_soil[DSM_SOIL_LAYERS];
+          for (int l = 0; l < DSM_SOIL_LAYERS; l++)
+          {
+            block_soil[l] = env->coarse_soil[l][b];
+          }
+#endif
+          for (int y = r; y < r + factor; y++)
+          {
+            for (int x = c; x < c + factor; x++)
+            {
+              int adr = grid_offset(env, y, x);
+              env->height_map[adr] += delta;
+#if DSM_SOIL_LAYERS > 0
+              // Blocks that gained soil hand their mix to every cell
+              soil_mix(env->soil, adr, block_soil, delta, env->height_map[adr]);
+#endif
+            }
+          }
+          // Corners cover every tile edge the block can touch
+          wake_cell(env, env->tile_awake, r, c);
+          wake_cell(env, env->tile_awake, r + factor-1, c + factor-1);
+        }
       }
     }
   }
 }
 
+bool any_tile_awake(Env* env)
+{
+  for (int t = 0; t < env->tiles_x*env->tiles_y; t++)
+  {
+    if (env->tile_awake[t])
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Run up to settle_sweeps erosion passes with the configured solver,
+ * stopping as soon as every tile is asleep. With coarse_factor set, the
+ * multiflow solver first relaxes each coarser level, coarse to fine.
+ */
+void settle(Env* env)
+{
+  int sweeps = env->settle_sweeps > 0 ? env->settle_sweeps : 1;
+  if (env->erosion_solver == SOLVER_MULTIFLOW && any_tile_awake(env))
+  {
+    for (int factor = env->coarse_factor; factor >= 2; factor /= 2)
+    {
+      erode_coarse(env, factor, sweeps);
+    }
+  }
+  for (int i = 0; i < sweeps && any_tile_awake(env); i++)
+  {
+    if (env->erosion_solver == SOLVER_MULTIFLOW)
+    {
+      int pass = env->settle_pass;
+      erode_multiflow(env, pass % 2, (pass / 2) % 2);
+    }
+    else
+    {
+      gradient(env);
+      erode(env);
+    }
+    env->settle_pass += 1;
+  }
+}
+
 /**
  * Plane fitting thing
  */
@@ -319,70 +1089,60 @@ void calculate_neighborhood_height(Env* env)
   // printf("Avg height: %f\n", env->agents[0].avg_height);
 }
 
-void blade_interaction(Env* env)
+/**
+ * Cut the soil under the blade down to blade height and push it into the
+ * three cells ahead. The agent's blade load is kept as a balance of the soil
+ * it carries: ground newly cut over the advance (in cells) since last step
+ * joins it, weighted by density when that layer exists, and soil spilling
+ * off the ends or left behind leaves it. width, blade_width and blade_fore
+ * are compile-time constants in the specialized builds.
+ */
+DSM_INLINE void blade_kernel(Env* env, const int width, const int blade_width, const int blade_fore, float advance)
 {
   Agent* agent = &env->agents[0];
   float true_blade_height = agent->avg_height + agent->blade_pos;
-  int overflow;
 
-  int n[20] = {-1, 0, -2, 1, -3, 2, -4, 3, -5, 4, -6, 5, -7, 6, -8, 7, -9, 8, -10, 9};
+  int direction;
+  if (agent->vel == 0)
+  {
+    direction = 1;
+  }
+  else
+  {
+    direction = agent->vel / abs(agent->vel);
+  }
 
-  for (int i = 0; i < agent->blade_width; i++)
+  float blade_yaw = agent->blade_yaw;
+  if (direction < 0)
   {
-    int x_n = n[i];
-  
-    int direction;
-    if (agent->vel == 0)
-    {
-      direction = 1;
-    }
-    else
-    {
-      direction = agent->vel / abs(agent->vel);
-    }
-  
-    float theta = agent->theta;
-  
-    Vector2 cut_1, cut_2, deposit_1, deposit_2, deposit_3, yaw_1, yaw_2, yaw_3, yaw_4, yaw_5;
-  
-    yaw_1.x = x_n;
-    yaw_2.x = x_n;
-    yaw_3.x = x_n;
-    yaw_4.x = x_n;
-    yaw_5.x = x_n;
-  
-    yaw_1.y = 0;
-    yaw_2.y = 1;
-    yaw_3.y = 2;
-    yaw_4.y = 3;
-    yaw_5.y = 4;
+    blade_yaw *= -1;
+  }
+
+  float sin_t = sinf(agent->theta);
+  float cos_t = cosf(agent->theta);
+  float sin_y = sinf(blade_yaw);
+  float cos_y = cosf(blade_yaw);
+  float fresh = 0;
+  int contact = 0;
+
+  for (int i = 0; i < blade_width; i++)
+  {
+    // Blade cells fan out from the middle: -1, 0, -2, 1, -3, 2, ...
+    int x_n = i % 2 == 0 ? -(i/2 + 1) : i/2;
   
-    float blade_yaw = agent->blade_yaw;
-    if (direction < 0)
+    // Rows 0-1 from the blade edge get cut, rows 2-4 take the soil
+    Vector2 pts[5];
+    int adrs[5];
+    for (int k = 0; k < 5; k++)
     {
-      blade_yaw *= -1;
+      Vector2 yaw = {x_n * cos_y + k * sin_y, -1*x_n * sin_y + k * cos_y};
+      pts[k].x = agent->x + (blade_fore + yaw.y * direction) * sin_t + (yaw.x) * cos_t;
+      pts[k].y = agent->y + (blade_fore + yaw.y * direction) * cos_t - (yaw.x) * sin_t;
+      adrs[k] = (int)pts[k].y * width + (int)pts[k].x;
     }
   
-    yaw_1 = rotate(yaw_1, blade_yaw);
-    yaw_2 = rotate(yaw_2, blade_yaw);
-    yaw_3 = rotate(yaw_3, blade_yaw);
-    yaw_4 = rotate(yaw_4, blade_yaw);
-    yaw_5 = rotate(yaw_5, blade_yaw);
-  
-    cut_1.x = agent->x + (agent->blade_fore + yaw_1.y * direction) * sinf(1*theta) + (yaw_1.x) * cosf(1*theta);
-    cut_1.y = agent->y + (agent->blade_fore + yaw_1.y * direction) * cosf(1*theta) - (yaw_1.x) * sinf(1*theta);
-    cut_2.x = agent->x + (agent->blade_fore + yaw_2.y * direction) * sinf(1*theta) + (yaw_2.x) * cosf(1*theta);
-    cut_2.y = agent->y + (agent->blade_fore + yaw_2.y * direction) * cosf(1*theta) - (yaw_2.x) * sinf(1*theta);
-  
-    deposit_1.x = agent->x + (agent->blade_fore + yaw_3.y * direction) * sinf(1*theta) + (yaw_3.x) * cosf(1*theta);
-    deposit_1.y = agent->y + (agent->blade_fore + yaw_3.y * direction) * cosf(1*theta) - (yaw_3.x) * sinf(1*theta);
-    deposit_2.x = agent->x + (agent->blade_fore + yaw_4.y * direction) * sinf(1*theta) + (yaw_4.x) * cosf(1*theta);
-    deposit_2.y = agent->y + (agent->blade_fore + yaw_4.y * direction) * cosf(1*theta) - (yaw_4.x) * sinf(1*theta);
-    deposit_3.x = agent->x + (agent->blade_fore + yaw_5.y * direction) * sinf(1*theta) + (yaw_5.x) * cosf(1*theta);
-    deposit_3.y = agent->y + (agent->blade_fore + yaw_5.y * direction) * cosf(1*theta) - (yaw_5.x) * sinf(1*theta);
-  
-    int height_1 = env->height_map[grid_offset(env, cut_1.y, cut_1.x)];
-    int height_2 = env->height_map[grid_offset(env, cut_2.y, cut_2.x)];
+    int height_1 = env->height_map[adrs[0]];
+    int height_2 = env->height_map[adrs[1]];
   
     if (true_blade_height <= height_1 || true_blade_height <= height_2)
     {
@@ -390,14 +1150,47 @@ void blade_interaction(Env* env)
       float height_diff_2 = height_2 - true_blade_height;
     
       float delta_soil = (height_diff_1 + height_diff_2) / 6;
+#if DSM_SOIL_LAYERS > 0
+      // The cut soil is the two cut cells' mix, by how much each gave
+      float cut_1 = height_diff_1 > 0 ? height_diff_1 : 0;
+      float cut_2 = height_diff_2 > 0 ? height_diff_2 : 0;
+      float share_1 = cut_1 + cut_2 > 0 ? cut_1 / (cut_1 + cut_2) : 0.5;
+      float cut_soil[DSM_SOIL_LAYERS];
+      for (int l = 0; l < DSM_SOIL_LAYERS; l++)
+      {
+        cut_soil[l] = env->soil[l][adrs[0]] * share_1 + env->soil[l][adrs[1]] * (1 - share_1);
+      }
+#endif
     
-      env->height_map[grid_offset(env, deposit_1.y, deposit_1.x)] += delta_soil * 2;
-      env->height_map[grid_offset(env, deposit_2.y, deposit_2.x)] += delta_soil * 2;
-      env->height_map[grid_offset(env, deposit_3.y, deposit_3.x)] += delta_soil * 2;
-      env->height_map[grid_offset(env, cut_1.y, cut_1.x)] = true_blade_height;
-      env->height_map[grid_offset(env, cut_2.y, cut_2.x)] = true_blade_height;
+      env->height_map[adrs[2]] += delta_soil * 2;
+      env->height_map[adrs[3]] += delta_soil * 2;
+      env->height_map[adrs[4]] += delta_soil * 2;
+#if DSM_SOIL_LAYERS > 0
+      for (int k = 2; k < 5; k++)
+      {
+        soil_mix(env->soil, adrs[k], cut_soil, delta_soil * 2, env->height_map[adrs[k]]);
+      }
+#endif
+      // Only the strip the leading row swept into since last step is new
+      // ground, and only below grade: soil above it, or already lying in
+      // the cut rows, is the pile coming round again
+      float ground = fminf(height_2, agent->avg_height) - true_blade_height;
+      float cut = ground > 0 ? ground * fminf(advance, 2) : 0;
+#ifdef DSM_SOIL_DENSITY
+      cut *= cut_soil[SOIL_DENSITY] / SOIL_DEFAULT_DENSITY;
+#endif
+      fresh += cut;
+      contact++;
+      env->height_map[adrs[0]] = true_blade_height;
+      env->height_map[adrs[1]] = true_blade_height;
+    
+      for (int k = 0; k < 5; k++)
+      {
+        wake_cell(env, env->tile_awake, pts[k].y, pts[k].x);
+      }
     }
     // printf("HIT! Shaved off %f\n", height - true_blade_height);
+#ifdef DSM_VERBOSE
     printf("Blade interaction!\n\
     \tLocation:\t(%i, %i) \n\
     \tAgent Theta:\t%f \n\
@@ -406,9 +1199,29 @@ void blade_interaction(Env* env)
     \tAvg height:\t%f\n\
     \tEnv Max:\t%f\n\
     \tEnv Mean:\t%f\n",
-    cut_1.x, cut_1.y, agent->theta, height_1, true_blade_height, agent->avg_height, env->max, env->mean);
+    pts[0].x, pts[0].y, agent->theta, height_1, true_blade_height, agent->avg_height, env->max, env->mean);
+#endif
   }
 
+  // Columns clear of the ground leave their share of the pile behind as the
+  // blade lifts or passes over it
+  float carried = agent->blade_load * contact / blade_width;
+  agent->blade_load = carried * (1 - BLADE_SPILL) + fresh;
+}
+
+void blade_interaction(Env* env, float advance)
+{
+  Agent* agent = &env->agents[0];
+#if defined(DSM_FIXED_WIDTH) && defined(DSM_FIXED_BLADE_WIDTH)
+  if (env->width == DSM_FIXED_WIDTH
+    && agent->blade_width == DSM_FIXED_BLADE_WIDTH
+    && agent->blade_fore == DSM_FIXED_BLADE_FORE)
+  {
+    blade_kernel(env, DSM_FIXED_WIDTH, DSM_FIXED_BLADE_WIDTH, DSM_FIXED_BLADE_FORE, advance);
+    return;
+  }
+#endif
+  blade_kernel(env, env->width, agent->blade_width, agent->blade_fore, advance);
 }
 
 /**
@@ -536,6 +1349,7 @@ bool step(Env* env)
   
   
     Agent* agent = &env->agents[agent_idx];
+    float theta = agent->theta;
     agent->theta += agent->theta_dot * TIMESTEP;
     if (agent->theta > 2*PI)
     {
@@ -553,8 +1367,10 @@ bool step(Env* env)
     // 0 is straight up, 90 is left...
     // also, this might be costly?
   
-    float dest_y = TIMESTEP * agent->vel * cosf(agent->theta) + y;
-    float dest_x = TIMESTEP * agent->vel * sinf(agent->theta) + x;
+    // Soil on the blade drags the dozer below its set speed
+    float speed = agent->vel / (1 + agent->blade_load / BLADE_HALF_LOAD);
+    float dest_y = TIMESTEP * speed * cosf(agent->theta) + y;
+    float dest_x = TIMESTEP * speed * sinf(agent->theta) + x;
   
     if (dest_y > env->height - 50)
     {
@@ -583,15 +1399,30 @@ bool step(Env* env)
       agent->x = dest_x;
     }
   
-    calculate_neighborhood_height(env);
-    blade_interaction(env);
+    // Blocked moves and turns don't happen, and the dozer stalls
+    if (footprint_blocked(env, agent, x, y, theta, agent->x, agent->y, agent->theta))
+    {
+      agent->x = x;
+      agent->y = y;
+      agent->theta = theta;
+      agent->vel = 0;
+      agent->theta_dot = 0;
+    }
   
-    int adr = grid_offset(env, y, x);
-    int dest_adr = grid_offset(env, dest_y, dest_x);
-    int dest_tile = env->grid[dest_adr];
+    calculate_neighborhood_height(env);
+    blade_interaction(env, hypotf(agent->x - x, agent->y - y));
   
-    gradient(env);
-    erode(env);
+    settle(env);
+  }
+
+#ifdef DSM_VERBOSE
+  height_stats(env);
+#endif
+
+  env->tick += 1;
+  if (env->recorder)
+  {
+    record_step(env->recorder, env);
   }
 
   return done;
@@ -690,7 +1521,11 @@ void render_global(Renderer* renderer, Env* env)
       int adr = grid_offset(env, r, c);
       int height = env->height_map[adr] * 3;
     
-      if (height > 255)
+      if (env->grid[adr] != EMPTY)
+      {
+        DrawRectangle(c*ts, r*ts, ts, ts, COLORS[env->grid[adr]]);
+      }
+      else if (height > 255)
       {
         DrawRectangle(c*ts, r*ts, ts, ts, (Color){255, 0, 0, 255});
       }
@@ -749,12 +1584,18 @@ Env* alloc_room_env()
   vision, agent_speed, discretize);
   
   env->cell_size = 1;
+  env->erosion_solver = SOLVER_STEEPEST;
+  env->settle_sweeps = 1;
   env->agents[0].spawn_y = 150;
   env->agents[0].spawn_x = 150;
   return env;
 }
 
 
+/**
+ * Restore the room's cells (empty unless a layout was saved with
+ * save_room_layout) and reset
+ */
 void reset_room(Env* env)
 {
   for (int r = 0; r < env->height; r++)
@@ -762,8 +1603,11 @@ void reset_room(Env* env)
     for (int c = 0; c < env->width; c++)
     {
       int adr = grid_offset(env, r, c);
-      env->grid[adr] = EMPTY;
+      env->grid[adr] = env->room_layout ? env->room_layout[adr] : EMPTY;
     }
   }
   reset(env, 0);
 }
+
+#include "recorder.h"
+#include "obstacles.h"
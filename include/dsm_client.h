@@ -0,0 +1,139 @@
+/**
+ * Client side of dsm_server. Attaches to the server's shared memory segment
+ * and steps one slice of its envs without linking the simulation.
+ *
+ *   DsmClient* client = dsm_client_connect("/dsm_rl", rank);
+ *   dsm_client_send(client, env_ids, actions, n);
+ *   n = dsm_client_recv(client, env_ids, batch_size);
+ *   const float* obs = dsm_client_obs(client, env_ids[0]);
+ *
+ * Env ids are local, 0..envs_per_client-1. Like the in-process pool, an env
+ * must come back from recv before it is sent again, and its obs, reward and
+ * done stay valid until then. Send -1 as the action to reset an env.
+ */
+#pragma once
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "dsm_shm.h"
+
+typedef struct DsmClient DsmClient;
+struct DsmClient
+{
+  ShmHeader* header;
+  ShmRingView actions;
+  ShmRingView results;
+  size_t size;  // of the mapping
+  int index;
+  int num_envs;
+  int first_env;  // global index of local env 0
+  int obs_size;   // floats per observation
+};
+
+DsmClient* dsm_client_connect(const char* name, int index)
+{
+  int fd = shm_open(name, O_RDWR, 0);
+  if (fd < 0)
+  {
+    printf("Could not open env server segment %s\n", name);
+    return NULL;
+  }
+
+  ShmHeader probe;
+  if (read(fd, &probe, sizeof(probe)) != sizeof(probe)
+    || probe.magic != SHM_MAGIC || probe.version != SHM_VERSION)
+  {
+    printf("%s is not a compatible env server segment\n", name);
+    close(fd);
+    return NULL;
+  }
+  if (index < 0 || index >= probe.num_clients)
+  {
+    printf("Client index %i out of range, server has %i slots\n", index, probe.num_clients);
+    close(fd);
+    return NULL;
+  }
+
+  void* base = mmap(NULL, probe.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+  {
+    printf("Could not map env server segment %s\n", name);
+    return NULL;
+  }
+
+  DsmClient* client = (DsmClient*)calloc(1, sizeof(DsmClient));
+  client->header = (ShmHeader*)base;
+  client->actions = shm_ring_view(base, &probe, index, false);
+  client->results = shm_ring_view(base, &probe, index, true);
+  client->size = probe.size;
+  client->index = index;
+  client->num_envs = probe.envs_per_client;
+  client->first_env = index * probe.envs_per_client;
+  client->obs_size = probe.width * probe.height;
+  return client;
+}
+
+void dsm_client_disconnect(DsmClient* client)
+{
+  munmap(client->header, client->size);
+  free(client);
+}
+
+void dsm_client_send(DsmClient* client, const int* env_ids, const int* actions, int count)
+{
+  for (int i = 0; i < count; i++)
+  {
+    ShmEntry entry = {env_ids[i], actions[i]};
+    bool pushed = shm_ring_push(&client->actions, entry);
+    assert(pushed);
+    (void)pushed;
+  }
+  atomic_fetch_add_explicit(&client->header->doorbell, 1, memory_order_release);
+  shm_futex_wake(&client->header->doorbell);
+}
+
+/**
+ * Wait for batch_size envs to finish, in completion order. Returns early
+ * with what it has if the server shuts down.
+ */
+int dsm_client_recv(DsmClient* client, int* env_ids, int batch_size)
+{
+  ShmRing* ring = client->results.ring;
+  int count = 0;
+  while (count < batch_size)
+  {
+    ShmEntry entry;
+    if (shm_ring_pop(&client->results, &entry))
+    {
+      env_ids[count++] = entry.env;
+      continue;
+    }
+    if (atomic_load(&client->header->shutdown))
+    {
+      break;
+    }
+    // Sleep until the server moves the tail past what we've consumed
+    uint32_t tail = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    shm_futex_wait(&ring->tail, tail, 100000);
+  }
+  return count;
+}
+
+const float* dsm_client_obs(DsmClient* client, int env)
+{
+  return shm_obs(client->header, client->first_env + env);
+}
+
+float dsm_client_reward(DsmClient* client, int env)
+{
+  return shm_rewards(client->header)[client->first_env + env];
+}
+
+bool dsm_client_done(DsmClient* client, int env)
+{
+  return shm_dones(client->header)[client->first_env + env];
+}
@@ -0,0 +1,229 @@
+/**
+ * Shared memory layout between dsm_server and its clients (Linux only).
+ *
+ * One POSIX shm segment holds everything:
+ *
+ *   ShmHeader
+ *   ShmClient[num_clients]     action and result rings per trainer
+ *   ShmEntry[num_clients][ring_capacity] x2   ring storage
+ *   float rewards[num_envs]
+ *   unsigned char dones[num_envs]
+ *   float obs[num_envs][width*height]   the envs' height maps, in place
+ *
+ * Client c owns envs [c*envs_per_client, (c+1)*envs_per_client) and refers
+ * to them by local index. Rings are single-producer/single-consumer with
+ * 32-bit counters that double as futex words: the server sleeps on the
+ * doorbell, a client sleeps on its result ring's tail.
+ *
+ * Clients can write the whole segment, so the server never takes sizes or
+ * offsets from it after setup: each side resolves its rings once into
+ * private ShmRingViews, and only the head and tail counters are shared.
+ */
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#define SHM_MAGIC 0x4d485344  // "DSHM"
+#define SHM_VERSION 2
+#define SHM_ALIGN 64
+
+typedef struct ShmEntry ShmEntry;
+struct ShmEntry
+{
+  int32_t env;     // local to the client
+  int32_t action;  // unused on the result ring
+};
+
+typedef struct ShmRing ShmRing;
+struct ShmRing
+{
+  _Alignas(SHM_ALIGN) atomic_uint head;
+  _Alignas(SHM_ALIGN) atomic_uint tail;
+};
+
+typedef struct ShmClient ShmClient;
+struct ShmClient
+{
+  ShmRing actions;  // client -> server
+  ShmRing results;  // server -> client
+};
+
+/**
+ * One end's private handle on a ring: only head and tail are read from the
+ * segment, and those are checked before use
+ */
+typedef struct ShmRingView ShmRingView;
+struct ShmRingView
+{
+  ShmRing* ring;
+  ShmEntry* entries;
+  uint32_t capacity;  // power of two
+  bool broken;        // the other side left tail - head out of range
+};
+
+typedef struct ShmHeader ShmHeader;
+struct ShmHeader
+{
+  uint32_t magic;
+  uint32_t version;
+  int32_t num_clients;
+  int32_t envs_per_client;
+  int32_t width;
+  int32_t height;
+  uint32_t ring_capacity;  // power of two
+  uint64_t rewards_offset;
+  uint64_t dones_offset;
+  uint64_t obs_offset;
+  uint64_t size;
+
+  _Alignas(SHM_ALIGN) atomic_uint doorbell;  // bumped by clients after sending
+  atomic_uint shutdown;
+};
+
+size_t shm_align(size_t offset)
+{
+  return (offset + SHM_ALIGN - 1) & ~(size_t)(SHM_ALIGN - 1);
+}
+
+/**
+ * Fill in the layout fields of header for the given configuration.
+ */
+void shm_layout(ShmHeader* header, int num_clients, int envs_per_client, int width, int height)
+{
+  uint32_t capacity = 1;
+  while (capacity < (uint32_t)envs_per_client)
+  {
+    capacity <<= 1;
+  }
+
+  int num_envs = num_clients * envs_per_client;
+  header->magic = SHM_MAGIC;
+  header->version = SHM_VERSION;
+  header->num_clients = num_clients;
+  header->envs_per_client = envs_per_client;
+  header->width = width;
+  header->height = height;
+  header->ring_capacity = capacity;
+
+  size_t offset = shm_align(sizeof(ShmHeader));
+  offset = shm_align(offset + num_clients * sizeof(ShmClient));
+  offset = shm_align(offset + 2 * num_clients * capacity * sizeof(ShmEntry));
+  header->rewards_offset = offset;
+  offset = shm_align(offset + num_envs * sizeof(float));
+  header->dones_offset = offset;
+  offset = shm_align(offset + num_envs);
+  header->obs_offset = offset;
+  offset = shm_align(offset + (size_t)num_envs * width * height * sizeof(float));
+  header->size = offset;
+}
+
+ShmClient* shm_clients(ShmHeader* header)
+{
+  return (ShmClient*)((char*)header + shm_align(sizeof(ShmHeader)));
+}
+
+/**
+ * Resolve client c's action or result ring in the segment at base. layout
+ * must be a private copy of the header (the server's own, or one a client
+ * read and checked), never the segment's.
+ */
+ShmRingView shm_ring_view(void* base, const ShmHeader* layout, int c, bool results)
+{
+  ShmClient* clients = shm_clients((ShmHeader*)base);
+  size_t storage = shm_align(shm_align(sizeof(ShmHeader)) + layout->num_clients * sizeof(ShmClient));
+  size_t ring_size = layout->ring_capacity * sizeof(ShmEntry);
+
+  ShmRingView view;
+  view.ring = results ? &clients[c].results : &clients[c].actions;
+  view.entries = (ShmEntry*)((char*)base + storage + (2*c + results) * ring_size);
+  view.capacity = layout->ring_capacity;
+  view.broken = false;
+  return view;
+}
+
+float* shm_rewards(ShmHeader* header)
+{
+  return (float*)((char*)header + header->rewards_offset);
+}
+
+unsigned char* shm_dones(ShmHeader* header)
+{
+  return (unsigned char*)header + header->dones_offset;
+}
+
+float* shm_obs(ShmHeader* header, int env)
+{
+  float* obs = (float*)((char*)header + header->obs_offset);
+  return obs + (size_t)env * header->width * header->height;
+}
+
+/**
+ * Zero every ring's counters. Server only, before clients connect.
+ */
+void shm_init_rings(ShmHeader* header)
+{
+  ShmClient* clients = shm_clients(header);
+  for (int c = 0; c < header->num_clients; c++)
+  {
+    atomic_init(&clients[c].actions.head, 0);
+    atomic_init(&clients[c].actions.tail, 0);
+    atomic_init(&clients[c].results.head, 0);
+    atomic_init(&clients[c].results.tail, 0);
+  }
+}
+
+/**
+ * Fails when the ring is full, or for good once it's broken
+ */
+bool shm_ring_push(ShmRingView* view, ShmEntry entry)
+{
+  uint32_t tail = atomic_load_explicit(&view->ring->tail, memory_order_relaxed);
+  uint32_t head = atomic_load_explicit(&view->ring->head, memory_order_acquire);
+  view->broken = view->broken || tail - head > view->capacity;
+  if (view->broken || tail - head == view->capacity)
+  {
+    return false;
+  }
+  view->entries[tail & (view->capacity - 1)] = entry;
+  atomic_store_explicit(&view->ring->tail, tail + 1, memory_order_release);
+  return true;
+}
+
+/**
+ * Fails when the ring is empty, or for good once it's broken
+ */
+bool shm_ring_pop(ShmRingView* view, ShmEntry* entry)
+{
+  uint32_t head = atomic_load_explicit(&view->ring->head, memory_order_relaxed);
+  uint32_t tail = atomic_load_explicit(&view->ring->tail, memory_order_acquire);
+  view->broken = view->broken || tail - head > view->capacity;
+  if (view->broken || head == tail)
+  {
+    return false;
+  }
+  *entry = view->entries[head & (view->capacity - 1)];
+  atomic_store_explicit(&view->ring->head, head + 1, memory_order_release);
+  return true;
+}
+
+/**
+ * Sleep while *word == expected, for at most timeout_us (0 = forever).
+ * Shared (non-private) futexes, since the word lives in a shared mapping.
+ */
+void shm_futex_wait(atomic_uint* word, uint32_t expected, long timeout_us)
+{
+  struct timespec timeout = {timeout_us / 1000000, (timeout_us % 1000000) * 1000};
+  syscall(SYS_futex, (uint32_t*)word, FUTEX_WAIT, expected, timeout_us ? &timeout : NULL, NULL, 0);
+}
+
+void shm_futex_wake(atomic_uint* word)
+{
+  syscall(SYS_futex, (uint32_t*)word, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
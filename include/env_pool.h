@@ -0,0 +1,411 @@
+/**
+ * Asynchronous env pool.
+ *
+ * Worker threads each own a fixed shard of envs (env i belongs to worker
+ * i % num_workers). The trainer hands out actions with pool_send() and gets
+ * back whichever envs finished first with pool_recv(), so a slow erosion
+ * step on one env never stalls the rest of the batch.
+ *
+ * Each worker has a single-producer/single-consumer ring in each direction,
+ * so no locks are taken on the hot path. An env is in flight at most once,
+ * which bounds every ring by its worker's shard size.
+ *
+ * Waiting sides spin briefly and then park on a PoolSignal, so idle workers
+ * and an idle trainer cost no CPU. Producers only take the signal's lock
+ * when someone is actually parked.
+ */
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include "dsm.h"
+#include "raster.h"
+
+#define POOL_RESET -1  // pseudo-action: reset the env instead of stepping
+#define POOL_CACHE_LINE 64
+#define POOL_SPINS 64  // empty polls before parking
+
+typedef struct SpscQueue SpscQueue;
+struct SpscQueue
+{
+  _Alignas(POOL_CACHE_LINE) atomic_size_t head;  // written by the consumer
+  _Alignas(POOL_CACHE_LINE) atomic_size_t tail;  // written by the producer
+  _Alignas(POOL_CACHE_LINE) int* items;
+  size_t mask;
+};
+
+void spsc_init(SpscQueue* queue, size_t min_capacity)
+{
+  size_t capacity = 1;
+  while (capacity < min_capacity)
+  {
+    capacity <<= 1;
+  }
+  atomic_init(&queue->head, 0);
+  atomic_init(&queue->tail, 0);
+  queue->items = (int*)calloc(capacity, sizeof(int));
+  queue->mask = capacity - 1;
+}
+
+void spsc_free(SpscQueue* queue)
+{
+  free(queue->items);
+}
+
+bool spsc_push(SpscQueue* queue, int item)
+{
+  size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+  if (tail - head > queue->mask)
+  {
+    return false;
+  }
+  queue->items[tail & queue->mask] = item;
+  atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+  return true;
+}
+
+bool spsc_pop(SpscQueue* queue, int* item)
+{
+  size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+  if (head == tail)
+  {
+    return false;
+  }
+  *item = queue->items[head & queue->mask];
+  atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+  return true;
+}
+
+/**
+ * Event count to park on while a queue is empty. A waiter reads the count,
+ * checks its queue, then sleeps only if nothing was notified since.
+ */
+typedef struct PoolSignal PoolSignal;
+struct PoolSignal
+{
+  _Alignas(POOL_CACHE_LINE) atomic_uint count;
+  atomic_int waiters;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+void pool_signal_init(PoolSignal* signal)
+{
+  atomic_init(&signal->count, 0);
+  atomic_init(&signal->waiters, 0);
+  pthread_mutex_init(&signal->lock, NULL);
+  pthread_cond_init(&signal->cond, NULL);
+}
+
+void pool_signal_free(PoolSignal* signal)
+{
+  pthread_mutex_destroy(&signal->lock);
+  pthread_cond_destroy(&signal->cond);
+}
+
+unsigned pool_signal_count(PoolSignal* signal)
+{
+  return atomic_load(&signal->count);
+}
+
+void pool_signal_notify(PoolSignal* signal)
+{
+  // Pairs with the waiter's increment of waiters: either it sees the new
+  // count or we see it waiting
+  atomic_fetch_add(&signal->count, 1);
+  if (atomic_load(&signal->waiters) > 0)
+  {
+    pthread_mutex_lock(&signal->lock);
+    pthread_cond_broadcast(&signal->cond);
+    pthread_mutex_unlock(&signal->lock);
+  }
+}
+
+/**
+ * Sleep until the count moves on from seen
+ */
+void pool_signal_wait(PoolSignal* signal, unsigned seen)
+{
+  pthread_mutex_lock(&signal->lock);
+  atomic_fetch_add(&signal->waiters, 1);
+  while (atomic_load(&signal->count) == seen)
+  {
+    pthread_cond_wait(&signal->cond, &signal->lock);
+  }
+  atomic_fetch_sub(&signal->waiters, 1);
+  pthread_mutex_unlock(&signal->lock);
+}
+
+typedef struct EnvPool EnvPool;
+
+typedef struct PoolWorker PoolWorker;
+struct PoolWorker
+{
+  EnvPool* pool;
+  pthread_t thread;
+  SpscQueue actions;  // trainer -> worker: env ids to step
+  SpscQueue results;  // worker -> trainer: env ids that finished
+  PoolSignal wake;    // notified when actions gets an entry
+};
+
+struct EnvPool
+{
+  int num_envs;
+  int num_workers;
+  Env** envs;
+  int* actions;  // pending action per env, published by the action queue
+  bool* dones;   // done flag of the last step, published by the result queue
+  Raster** rasters;  // per env pixel observations, NULL unless enabled
+  PoolWorker* workers;
+  int next_worker;  // round robin start for pool_recv
+  atomic_bool running;
+  PoolSignal finished;  // notified when any results queue gets an entry
+
+  // Optional, called by workers after each result, e.g. to wake a thread
+  // that waits on something else besides this pool
+  void (*on_result)(void* arg);
+  void* on_result_arg;
+};
+
+void* pool_worker_loop(void* arg)
+{
+  PoolWorker* worker = (PoolWorker*)arg;
+  EnvPool* pool = worker->pool;
+  int spins = 0;
+
+  while (true)
+  {
+    // Read the count before running, so the wake-up free_env_pool sends
+    // after clearing running can't slip in between
+    unsigned seen = pool_signal_count(&worker->wake);
+    if (!atomic_load(&pool->running))
+    {
+      break;
+    }
+
+    int env_idx;
+    if (!spsc_pop(&worker->actions, &env_idx))
+    {
+      if (spins < POOL_SPINS)
+      {
+        spins++;
+      }
+      else
+      {
+        pool_signal_wait(&worker->wake, seen);
+      }
+      continue;
+    }
+    spins = 0;
+
+    Env* env = pool->envs[env_idx];
+    int action = pool->actions[env_idx];
+    if (action == POOL_RESET)
+    {
+      reset_room(env);
+      pool->dones[env_idx] = false;
+    }
+    else
+    {
+      env->action = action;
+      bool done = step(env);
+      if (done)
+      {
+        reset_room(env);
+      }
+      pool->dones[env_idx] = done;
+    }
+    if (pool->rasters)
+    {
+      render_raster(pool->rasters[env_idx], env);
+    }
+
+    // Can't overflow: the env was only in this worker's hands once
+    bool pushed = spsc_push(&worker->results, env_idx);
+    assert(pushed);
+    (void)pushed;
+    pool_signal_notify(&pool->finished);
+    if (pool->on_result)
+    {
+      pool->on_result(pool->on_result_arg);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Allocate num_envs room envs and start num_workers threads over them.
+ * Envs are not reset; send POOL_RESET to each before stepping.
+ */
+EnvPool* create_env_pool(int num_envs, int num_workers)
+{
+  assert(num_envs > 0 && num_workers > 0);
+  if (num_workers > num_envs)
+  {
+    num_workers = num_envs;
+  }
+
+  EnvPool* pool = (EnvPool*)calloc(1, sizeof(EnvPool));
+  pool->num_envs = num_envs;
+  pool->num_workers = num_workers;
+  pool->envs = (Env**)calloc(num_envs, sizeof(Env*));
+  pool->actions = (int*)calloc(num_envs, sizeof(int));
+  pool->dones = (bool*)calloc(num_envs, sizeof(bool));
+  pool->workers = (PoolWorker*)aligned_alloc(POOL_CACHE_LINE,
+    ((num_workers * sizeof(PoolWorker) + POOL_CACHE_LINE - 1) / POOL_CACHE_LINE) * POOL_CACHE_LINE);
+  atomic_init(&pool->running, true);
+  pool_signal_init(&pool->finished);
+
+  for (int i = 0; i < num_envs; i++)
+  {
+    pool->envs[i] = alloc_room_env();
+  }
+
+  int shard_size = (num_envs + num_workers - 1) / num_workers;
+  for (int w = 0; w < num_workers; w++)
+  {
+    PoolWorker* worker = &pool->workers[w];
+    worker->pool = pool;
+    spsc_init(&worker->actions, shard_size);
+    spsc_init(&worker->results, shard_size);
+    pool_signal_init(&worker->wake);
+  }
+  for (int w = 0; w < num_workers; w++)
+  {
+    pthread_create(&pool->workers[w].thread, NULL, pool_worker_loop, &pool->workers[w]);
+  }
+  return pool;
+}
+
+void free_env_pool(EnvPool* pool)
+{
+  atomic_store(&pool->running, false);
+  for (int w = 0; w < pool->num_workers; w++)
+  {
+    pool_signal_notify(&pool->workers[w].wake);
+  }
+  for (int w = 0; w < pool->num_workers; w++)
+  {
+    pthread_join(pool->workers[w].thread, NULL);
+    spsc_free(&pool->workers[w].actions);
+    spsc_free(&pool->workers[w].results);
+    pool_signal_free(&pool->workers[w].wake);
+  }
+  pool_signal_free(&pool->finished);
+  for (int i = 0; i < pool->num_envs; i++)
+  {
+    free_allocated_grid(pool->envs[i]);
+    if (pool->rasters)
+    {
+      free_raster(pool->rasters[i]);
+    }
+  }
+  free(pool->rasters);
+  free(pool->envs);
+  free(pool->actions);
+  free(pool->dones);
+  free(pool->workers);
+  free(pool);
+}
+
+/**
+ * Have workers render each env to a width x height RGB frame after every
+ * step or reset, readable from pool->rasters[env]->rgb along with the rest
+ * of the env's state. Call before sending anything.
+ */
+void pool_enable_pixels(EnvPool* pool, int width, int height)
+{
+  assert(!pool->rasters);
+  pool->rasters = (Raster**)calloc(pool->num_envs, sizeof(Raster*));
+  for (int i = 0; i < pool->num_envs; i++)
+  {
+    pool->rasters[i] = create_raster(pool->envs[i]->width, pool->envs[i]->height, width, height);
+  }
+}
+
+/**
+ * Queue one action per listed env. An env must have been received back
+ * (or never sent) before it is sent again.
+ */
+void pool_send(EnvPool* pool, const int* env_ids, const int* actions, int count)
+{
+  for (int i = 0; i < count; i++)
+  {
+    int env_idx = env_ids[i];
+    pool->actions[env_idx] = actions[i];
+    PoolWorker* worker = &pool->workers[env_idx % pool->num_workers];
+    bool pushed = spsc_push(&worker->actions, env_idx);
+    assert(pushed);
+    (void)pushed;
+    pool_signal_notify(&worker->wake);
+  }
+}
+
+/**
+ * Collect up to max_count finished env ids without waiting.
+ */
+int pool_poll(EnvPool* pool, int* env_ids, int max_count)
+{
+  int count = 0;
+  for (int k = 0; k < pool->num_workers && count < max_count; k++)
+  {
+    int w = (pool->next_worker + k) % pool->num_workers;
+    while (count < max_count && spsc_pop(&pool->workers[w].results, &env_ids[count]))
+    {
+      count++;
+    }
+  }
+  // Start the next sweep elsewhere so one busy worker can't hog batches
+  pool->next_worker = (pool->next_worker + 1) % pool->num_workers;
+  return count;
+}
+
+/**
+ * Wait until batch_size envs have finished and write their ids to env_ids,
+ * in completion order. Their state and pool->dones are safe to read until
+ * they are sent again.
+ */
+int pool_recv(EnvPool* pool, int* env_ids, int batch_size)
+{
+  int count = 0;
+  int spins = 0;
+  while (count < batch_size)
+  {
+    unsigned seen = pool_signal_count(&pool->finished);
+    int got = pool_poll(pool, env_ids + count, batch_size - count);
+    count += got;
+    if (got > 0)
+    {
+      spins = 0;
+    }
+    else if (spins < POOL_SPINS)
+    {
+      spins++;
+    }
+    else
+    {
+      pool_signal_wait(&pool->finished, seen);
+    }
+  }
+  return count;
+}
+
+/**
+ * Reset every env through its worker and wait for all of them.
+ */
+void pool_reset(EnvPool* pool)
+{
+  int* ids = (int*)malloc(pool->num_envs * sizeof(int));
+  int* actions = (int*)malloc(pool->num_envs * sizeof(int));
+  for (int i = 0; i < pool->num_envs; i++)
+  {
+    ids[i] = i;
+    actions[i] = POOL_RESET;
+  }
+  pool_send(pool, ids, actions, pool->num_envs);
+  pool_recv(pool, ids, pool->num_envs);
+  free(ids);
+  free(actions);
+}
@@ -0,0 +1,303 @@
+/**
+ * Packed obstacle layer and swept footprint collision.
+ *
+ * Included at the bottom of dsm.h. env->obstacles holds one bit per cell,
+ * rows padded to whole 64-bit words, set where env->grid has a blocking
+ * cell type (WALL, LAVA, OBJECT). A footprint query rasterizes a convex
+ * polygon into one [lo, hi] column span per row and ANDs each span against
+ * the row's words, so a 30 cell wide dozer costs one or two words per row.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#define AGENT_REAR 5   // body extent behind the agent position, in cells
+#define BLADE_DEPTH 5  // cut and deposit rows in front of blade_fore
+
+bool is_blocking(unsigned char tile)
+{
+  return tile == WALL || tile == LAVA || tile == OBJECT;
+}
+
+void set_obstacle_bit(Env* env, int y, int x, bool blocked)
+{
+  uint64_t* word = &env->obstacles[y*env->obstacle_words + x/64];
+  uint64_t bit = (uint64_t)1 << (x % 64);
+  if (blocked)
+  {
+    *word |= bit;
+  }
+  else
+  {
+    *word &= ~bit;
+  }
+}
+
+/**
+ * Keep the current grid (walls, objects placed with set_obstacle_rect...) as
+ * the layout reset_room() restores, so obstacles survive episode resets.
+ * Recordings don't store cells: replay into an env with the same layout.
+ */
+void save_room_layout(Env* env)
+{
+  if (!env->room_layout)
+  {
+    env->room_layout = (unsigned char*)malloc(env->width*env->height*sizeof(unsigned char));
+  }
+  memcpy(env->room_layout, env->grid, env->width*env->height*sizeof(unsigned char));
+}
+
+/**
+ * Rebuild the bit layer from env->grid. Called by reset(); call it again
+ * after writing to the grid directly.
+ */
+void sync_obstacles(Env* env)
+{
+  memset(env->obstacles, 0, env->height*env->obstacle_words*sizeof(uint64_t));
+  env->num_obstacles = 0;
+  for (int r = 0; r < env->height; r++)
+  {
+    for (int c = 0; c < env->width; c++)
+    {
+      if (is_blocking(env->grid[grid_offset(env, r, c)]))
+      {
+        set_obstacle_bit(env, r, c, true);
+        env->num_obstacles += 1;
+      }
+    }
+  }
+}
+
+/**
+ * Fill the cells [y0, y1) x [x0, x1) with a cell type, keeping the bit
+ * layer in step.
+ */
+void set_obstacle_rect(Env* env, int y0, int x0, int y1, int x1, unsigned char tile)
+{
+  y0 = y0 < 0 ? 0 : y0;
+  x0 = x0 < 0 ? 0 : x0;
+  y1 = y1 > env->height ? env->height : y1;
+  x1 = x1 > env->width ? env->width : x1;
+
+  for (int r = y0; r < y1; r++)
+  {
+    for (int c = x0; c < x1; c++)
+    {
+      int adr = grid_offset(env, r, c);
+      env->num_obstacles += is_blocking(tile) - is_blocking(env->grid[adr]);
+      env->grid[adr] = tile;
+      set_obstacle_bit(env, r, c, is_blocking(tile));
+    }
+  }
+}
+
+/**
+ * Convex hull of up to 8 points, counter-clockwise, in place. Returns the
+ * vertex count.
+ */
+int convex_hull(Vector2* pts, int n)
+{
+  // Insertion sort by x then y, n is tiny
+  for (int i = 1; i < n; i++)
+  {
+    Vector2 p = pts[i];
+    int j = i - 1;
+    while (j >= 0 && (pts[j].x > p.x || (pts[j].x == p.x && pts[j].y > p.y)))
+    {
+      pts[j+1] = pts[j];
+      j--;
+    }
+    pts[j+1] = p;
+  }
+
+  Vector2 hull[16];
+  int k = 0;
+  for (int pass = 0; pass < 2; pass++)
+  {
+    int start = k;
+    for (int i = 0; i < n; i++)
+    {
+      Vector2 p = pass == 0 ? pts[i] : pts[n-1 - i];
+      while (k >= start + 2)
+      {
+        Vector2 a = hull[k-2];
+        Vector2 b = hull[k-1];
+        float cross = (b.x - a.x)*(p.y - a.y) - (b.y - a.y)*(p.x - a.x);
+        if (cross > 0)
+        {
+          break;
+        }
+        k--;
+      }
+      hull[k++] = p;
+    }
+    k--;  // last point of each chain starts the other
+  }
+
+  for (int i = 0; i < k; i++)
+  {
+    pts[i] = hull[i];
+  }
+  return k;
+}
+
+/**
+ * Column span [span_lo, span_hi] of every row a convex polygon touches,
+ * conservatively: each edge marks all cells it passes through. Returns the
+ * row range in *row_lo, *row_hi (inclusive), unclipped.
+ */
+void polygon_spans(Env* env, const Vector2* poly, int n, int* row_lo, int* row_hi)
+{
+  float y_min = poly[0].y;
+  float y_max = poly[0].y;
+  for (int i = 1; i < n; i++)
+  {
+    y_min = poly[i].y < y_min ? poly[i].y : y_min;
+    y_max = poly[i].y > y_max ? poly[i].y : y_max;
+  }
+  *row_lo = floorf(y_min);
+  *row_hi = floorf(y_max);
+
+  for (int r = *row_lo; r <= *row_hi; r++)
+  {
+    if (r >= 0 && r < env->height)
+    {
+      env->span_lo[r] = INT32_MAX;
+      env->span_hi[r] = INT32_MIN;
+    }
+  }
+
+  for (int i = 0; i < n; i++)
+  {
+    Vector2 a = poly[i];
+    Vector2 b = poly[(i+1) % n];
+    if (a.y > b.y)
+    {
+      Vector2 t = a;
+      a = b;
+      b = t;
+    }
+
+    for (int r = floorf(a.y); r <= floorf(b.y); r++)
+    {
+      if (r < 0 || r >= env->height)
+      {
+        continue;
+      }
+      // Part of the edge inside this row
+      float ya = a.y > r ? a.y : r;
+      float yb = b.y < r + 1 ? b.y : r + 1;
+      float xa = a.x;
+      float xb = b.x;
+      if (b.y > a.y)
+      {
+        xa = a.x + (b.x - a.x) * (ya - a.y) / (b.y - a.y);
+        xb = a.x + (b.x - a.x) * (yb - a.y) / (b.y - a.y);
+      }
+      int lo = floorf(xa < xb ? xa : xb);
+      int hi = floorf(xa < xb ? xb : xa);
+      env->span_lo[r] = lo < env->span_lo[r] ? lo : env->span_lo[r];
+      env->span_hi[r] = hi > env->span_hi[r] ? hi : env->span_hi[r];
+    }
+  }
+}
+
+/**
+ * True if any cell in the spans of rows [row_lo, row_hi] is an obstacle
+ * or off the map.
+ */
+bool spans_blocked(Env* env, int row_lo, int row_hi)
+{
+  if (row_lo < 0 || row_hi >= env->height)
+  {
+    return true;
+  }
+
+  for (int r = row_lo; r <= row_hi; r++)
+  {
+    int lo = env->span_lo[r];
+    int hi = env->span_hi[r];
+    if (lo > hi)
+    {
+      continue;
+    }
+    if (lo < 0 || hi >= env->width)
+    {
+      return true;
+    }
+
+    const uint64_t* row = &env->obstacles[r*env->obstacle_words];
+    int w_lo = lo / 64;
+    int w_hi = hi / 64;
+    uint64_t first = ~(uint64_t)0 << (lo % 64);
+    uint64_t last = ~(uint64_t)0 >> (63 - hi % 64);
+
+    if (w_lo == w_hi)
+    {
+      if (row[w_lo] & first & last)
+      {
+        return true;
+      }
+      continue;
+    }
+    uint64_t hits = (row[w_lo] & first) | (row[w_hi] & last);
+    for (int w = w_lo + 1; w < w_hi; w++)
+    {
+      hits |= row[w];
+    }
+    if (hits)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Whether moving the agent's body and blade from (x0, y0) at heading theta0
+ * to (x1, y1) at theta1 sweeps over an obstacle. At each pose the footprint
+ * is a box from AGENT_REAR behind the agent to the far edge of the blade's
+ * cut and deposit rows, wide enough for both at the current blade_yaw; the
+ * sweep is the hull of the two boxes.
+ */
+bool footprint_blocked(Env* env, Agent* agent, float x0, float y0, float theta0, float x1, float y1, float theta1)
+{
+  if (env->num_obstacles == 0)
+  {
+    return false;
+  }
+
+  // Yawing the blade (either way, it flips when reversing) swings the ends
+  // of its BLADE_DEPTH rows forward, back and out
+  float half = 0.5 * agent->blade_width;
+  float sin_y = fabsf(sinf(agent->blade_yaw));
+  float cos_y = cosf(agent->blade_yaw);
+  float reach = half * sin_y + BLADE_DEPTH * cos_y;
+  float lat_max = half * cos_y + BLADE_DEPTH * sin_y;
+  lat_max = lat_max > half ? lat_max : half;
+  float fore = agent->blade_fore + reach;
+  float rear = agent->blade_fore - reach < -AGENT_REAR ? agent->blade_fore - reach : -AGENT_REAR;
+
+  float corners[4][2] = {{-lat_max, rear}, {lat_max, rear}, {lat_max, fore}, {-lat_max, fore}};
+  float poses[2][3] = {{x0, y0, theta0}, {x1, y1, theta1}};
+  Vector2 pts[8];
+  for (int p = 0; p < 2; p++)
+  {
+    // Same frame as blade_interaction: forward is (sin, cos), lateral is
+    // (cos, -sin)
+    float s = sinf(poses[p][2]);
+    float c = cosf(poses[p][2]);
+    for (int i = 0; i < 4; i++)
+    {
+      float lat = corners[i][0];
+      float fwd = corners[i][1];
+      pts[4*p + i] = (Vector2){poses[p][0] + fwd * s + lat * c, poses[p][1] + fwd * c - lat * s};
+    }
+  }
+
+  int n = convex_hull(pts, 8);
+  int row_lo;
+  int row_hi;
+  polygon_spans(env, pts, n, &row_lo, &row_hi);
+  return spans_blocked(env, row_lo, row_hi);
+}
@@ -0,0 +1,261 @@
+/**
+ * Headless software renderer for pixel observations and video frames.
+ *
+ * Draws the same picture as render_global (grey height map, grid cells in
+ * their COLORS, yellow blade, red agent) straight into an RGB buffer, no
+ * window or GPU needed. Each Raster belongs to one env, so envs can be
+ * rendered in parallel from the pool's worker threads.
+ *
+ * The picture is drawn at map resolution and box filtered down when the
+ * output is smaller.
+ */
+#pragma once
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "dsm.h"
+
+typedef struct Raster Raster;
+struct Raster
+{
+  int map_width;
+  int map_height;
+  int width;   // output size
+  int height;
+  unsigned char* rgb;   // width*height*3, row major
+  unsigned char* full;  // map sized scratch, same as rgb when not scaling
+  unsigned char* grey;  // one map row of colormapped heights
+  unsigned char* hot;   // one map row, 0xff where the height overflows
+  int* col_lo;  // source columns of each output column
+  int* col_hi;
+};
+
+Raster* create_raster(int map_width, int map_height, int width, int height)
+{
+  Raster* raster = (Raster*)calloc(1, sizeof(Raster));
+  raster->map_width = map_width;
+  raster->map_height = map_height;
+  raster->width = width;
+  raster->height = height;
+  raster->rgb = (unsigned char*)calloc(width*height*3, sizeof(unsigned char));
+  if (width == map_width && height == map_height)
+  {
+    raster->full = raster->rgb;
+  }
+  else
+  {
+    raster->full = (unsigned char*)calloc(map_width*map_height*3, sizeof(unsigned char));
+  }
+  // Padded so the vector loop can run past the end of a row
+  raster->grey = (unsigned char*)calloc(map_width + 16, sizeof(unsigned char));
+  raster->hot = (unsigned char*)calloc(map_width + 16, sizeof(unsigned char));
+
+  raster->col_lo = (int*)calloc(width, sizeof(int));
+  raster->col_hi = (int*)calloc(width, sizeof(int));
+  for (int c = 0; c < width; c++)
+  {
+    raster->col_lo[c] = c * map_width / width;
+    raster->col_hi[c] = (c+1) * map_width / width;
+    if (raster->col_hi[c] == raster->col_lo[c])
+    {
+      raster->col_hi[c] += 1;
+    }
+  }
+  return raster;
+}
+
+void free_raster(Raster* raster)
+{
+  if (raster->full != raster->rgb)
+  {
+    free(raster->full);
+  }
+  free(raster->rgb);
+  free(raster->grey);
+  free(raster->hot);
+  free(raster->col_lo);
+  free(raster->col_hi);
+  free(raster);
+}
+
+/**
+ * grey = clamp(3*height, 0, 255) and hot = 0xff where 3*height > 255,
+ * for one row
+ */
+void colormap_row(const float* heights, unsigned char* grey, unsigned char* hot, int n)
+{
+  int c = 0;
+#ifdef __SSE2__
+  const __m128 three = _mm_set1_ps(3);
+  const __m128i limit = _mm_set1_epi32(255);
+  for (; c + 16 <= n; c += 16)
+  {
+    __m128i v[4];
+    for (int k = 0; k < 4; k++)
+    {
+      // Truncate like the (int) cast in render_global
+      v[k] = _mm_cvttps_epi32(_mm_mul_ps(_mm_loadu_ps(heights + c + 4*k), three));
+    }
+    __m128i hot16 = _mm_packs_epi32(_mm_cmpgt_epi32(v[0], limit), _mm_cmpgt_epi32(v[1], limit));
+    __m128i hot16b = _mm_packs_epi32(_mm_cmpgt_epi32(v[2], limit), _mm_cmpgt_epi32(v[3], limit));
+    // Signed then unsigned saturation clamps to [0, 255]
+    __m128i lo = _mm_packs_epi32(v[0], v[1]);
+    __m128i hi = _mm_packs_epi32(v[2], v[3]);
+    _mm_storeu_si128((__m128i*)(grey + c), _mm_packus_epi16(lo, hi));
+    _mm_storeu_si128((__m128i*)(hot + c), _mm_packs_epi16(hot16, hot16b));
+  }
+#endif
+  for (; c < n; c++)
+  {
+    int v = heights[c] * 3;
+    hot[c] = v > 255 ? 0xff : 0;
+    grey[c] = v > 255 ? 255 : v < 0 ? 0 : v;
+  }
+}
+
+void raster_fill_spans(Raster* raster, Env* env, int row_lo, int row_hi, Color color)
+{
+  for (int r = row_lo; r <= row_hi; r++)
+  {
+    if (r < 0 || r >= raster->map_height)
+    {
+      continue;
+    }
+    int lo = env->span_lo[r] < 0 ? 0 : env->span_lo[r];
+    int hi = env->span_hi[r] >= raster->map_width ? raster->map_width-1 : env->span_hi[r];
+    unsigned char* px = raster->full + (r*raster->map_width + lo)*3;
+    for (int c = lo; c <= hi; c++, px += 3)
+    {
+      px[0] = color.r;
+      px[1] = color.g;
+      px[2] = color.b;
+    }
+  }
+}
+
+/**
+ * Draw env into raster->rgb
+ */
+void render_raster(Raster* raster, Env* env)
+{
+  int w = raster->map_width;
+  int h = raster->map_height;
+  assert(w == env->width && h == env->height);
+
+  for (int r = 0; r < h; r++)
+  {
+    const float* heights = &env->height_map[grid_offset(env, r, 0)];
+    const unsigned char* cells = &env->grid[grid_offset(env, r, 0)];
+    unsigned char* px = raster->full + r*w*3;
+    colormap_row(heights, raster->grey, raster->hot, w);
+
+    for (int c = 0; c < w; c++)
+    {
+      // Overflow shows red (255, 0, 0): keep red, mask off green and blue
+      unsigned char g = raster->grey[c];
+      unsigned char keep = ~raster->hot[c];
+      px[3*c] = g;
+      px[3*c+1] = g & keep;
+      px[3*c+2] = g & keep;
+    }
+    for (int c = 0; c < w; c++)
+    {
+      if (cells[c] != EMPTY)
+      {
+        Color color = COLORS[cells[c]];
+        px[3*c] = color.r;
+        px[3*c+1] = color.g;
+        px[3*c+2] = color.b;
+      }
+    }
+  }
+
+  // Blade and agent marker, as in render_global
+  Agent* agent = &env->agents[0];
+  float s = sinf(agent->theta);
+  float c = cosf(agent->theta);
+  float half = 0.5 * agent->blade_width;
+  float corners[4][2] = {
+    {-half, agent->blade_fore},
+    {half, agent->blade_fore},
+    {half, agent->blade_fore + agent->blade_thick},
+    {-half, agent->blade_fore + agent->blade_thick}
+  };
+  Vector2 blade[4];
+  for (int i = 0; i < 4; i++)
+  {
+    blade[i].x = agent->x + corners[i][1] * s + corners[i][0] * c;
+    blade[i].y = agent->y + corners[i][1] * c - corners[i][0] * s;
+  }
+  int row_lo;
+  int row_hi;
+  polygon_spans(env, blade, 4, &row_lo, &row_hi);
+  raster_fill_spans(raster, env, row_lo, row_hi, YELLOW);
+
+  int radius = 5;
+  for (int dy = -radius; dy <= radius; dy++)
+  {
+    int r = agent->y + dy;
+    if (r < 0 || r >= h)
+    {
+      continue;
+    }
+    int dx = sqrtf(radius*radius - dy*dy);
+    env->span_lo[r] = agent->x - dx;
+    env->span_hi[r] = agent->x + dx;
+    raster_fill_spans(raster, env, r, r, RED);
+  }
+
+  if (raster->full == raster->rgb)
+  {
+    return;
+  }
+
+  // Box filter down to the output size
+  for (int r = 0; r < raster->height; r++)
+  {
+    int r_lo = r * h / raster->height;
+    int r_hi = (r+1) * h / raster->height;
+    r_hi = r_hi == r_lo ? r_lo + 1 : r_hi;
+
+    for (int oc = 0; oc < raster->width; oc++)
+    {
+      int sum[3] = {0, 0, 0};
+      int c_lo = raster->col_lo[oc];
+      int c_hi = raster->col_hi[oc];
+      for (int y = r_lo; y < r_hi; y++)
+      {
+        const unsigned char* px = raster->full + (y*w + c_lo)*3;
+        for (int x = c_lo; x < c_hi; x++, px += 3)
+        {
+          sum[0] += px[0];
+          sum[1] += px[1];
+          sum[2] += px[2];
+        }
+      }
+      int count = (r_hi - r_lo) * (c_hi - c_lo);
+      unsigned char* out = raster->rgb + (r*raster->width + oc)*3;
+      out[0] = sum[0] / count;
+      out[1] = sum[1] / count;
+      out[2] = sum[2] / count;
+    }
+  }
+}
+
+/**
+ * Write an RGB buffer as a binary PPM, e.g. one video frame
+ */
+bool write_ppm(const char* path, const unsigned char* rgb, int width, int height)
+{
+  FILE* file = fopen(path, "wb");
+  if (!file)
+  {
+    printf("Could not write frame: %s\n", path);
+    return false;
+  }
+  fprintf(file, "P6\n%i %i\n255\n", width, height);
+  fwrite(rgb, 3, width*height, file);
+  fclose(file);
+  return true;
+}
@@ -0,0 +1,747 @@
+/**
+ * Trajectory recording and replay.
+ *
+ * Included at the bottom of dsm.h. A recording is an append-only stream:
+ *
+ *   header    magic, version, map size, agent count, frame intervals
+ *   records   a one-byte tag followed by its payload
+ *     REC_RESET     seed, then a keyframe
+ *     REC_STEP      action, then the sim state after the step
+ *     REC_KEYFRAME  step index, sim state, wake flags, full maps
+ *     REC_DELTA     step index, wake flags, map changes since the last frame
+ *
+ * A frame's step index is the number of steps recorded before it, and the
+ * frame holds the state after that many steps. The keyframe a reset writes
+ * is the exception once steps have been recorded: it shares the index of the
+ * step before it, but holds the state the next step starts from. Replay
+ * orders it between the two, so seeking to that index still shows the
+ * episode's final state.
+ *
+ * Sim state is everything step() carries besides the maps: tick, settle
+ * pass counter and the Agent structs. Wake flags are env->tile_awake
+ * packed one bit per tile; which tiles erode (and which coarse blocks are
+ * fixed halo) depends on them, so seeks restore them exactly. The maps are
+ * the height map followed by each soil layer the build has (DSM_SOIL_*),
+ * one packed payload each; a recording only replays in a build with the
+ * same layers.
+ *
+ * Maps are stored as 32-bit words XORed against a reference (the
+ * previous frame for deltas, the previous cell for keyframes) and packed as
+ * (zero run, literal count, literals...). Untouched terrain costs nothing:
+ * deltas only read the tiles env->tile_dirty marks as changed since the
+ * last frame.
+ *
+ * The sim is deterministic given the actions, so replay only needs frames to
+ * seek: jump to the nearest keyframe, roll deltas forward, then re-simulate
+ * the remaining steps.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#define REC_MAGIC 0x524d5344  // "DSMR"
+#define REC_VERSION 5
+
+#define REC_RESET 1
+#define REC_STEP 2
+#define REC_KEYFRAME 3
+#define REC_DELTA 4
+
+#define REC_FRAME_INTERVAL 8     // steps between height map frames
+#define REC_KEYFRAME_INTERVAL 32 // frames between keyframes
+
+#define REC_MAPS (1 + DSM_SOIL_LAYERS)  // height map, then soil layers
+
+// Which soil layers the build has, one bit each in layer order
+#if defined(DSM_SOIL_DENSITY)
+#define REC_SOIL_DENSITY_BIT 1
+#else
+#define REC_SOIL_DENSITY_BIT 0
+#endif
+#if defined(DSM_SOIL_MOISTURE)
+#define REC_SOIL_MOISTURE_BIT 2
+#else
+#define REC_SOIL_MOISTURE_BIT 0
+#endif
+#if defined(DSM_SOIL_COMPACTION)
+#define REC_SOIL_COMPACTION_BIT 4
+#else
+#define REC_SOIL_COMPACTION_BIT 0
+#endif
+#define REC_SOIL_LAYERS (REC_SOIL_DENSITY_BIT | REC_SOIL_MOISTURE_BIT | REC_SOIL_COMPACTION_BIT)
+
+typedef struct RecHeader RecHeader;
+struct RecHeader
+{
+  uint32_t magic;
+  uint32_t version;
+  int32_t width;
+  int32_t height;
+  int32_t num_agents;
+  int32_t frame_interval;
+  int32_t keyframe_interval;
+  uint32_t agent_size;
+
+  // Erosion settings, replay needs the same ones to re-simulate
+  int32_t erosion_solver;
+  int32_t settle_sweeps;
+  int32_t coarse_factor;
+
+  int32_t soil_layers;  // REC_SOIL_LAYERS of the recording build
+};
+
+struct Recorder
+{
+  FILE* file;
+  RecHeader header;
+
+  long steps;   // steps recorded so far, across resets
+  long frames;  // frames since the last keyframe
+
+  uint32_t* prev_frame;  // REC_MAPS maps of width*height words
+  uint32_t* scratch;
+};
+
+/**
+ * Map m of a frame as words: the height map, then the soil layers
+ */
+uint32_t* rec_map(Env* env, int m)
+{
+#if DSM_SOIL_LAYERS > 0
+  if (m > 0)
+  {
+    return (uint32_t*)env->soil[m-1];
+  }
+#endif
+  return (uint32_t*)env->height_map;
+}
+
+/**
+ * XOR each word against its reference and pack the result as zero runs and
+ * literals. A NULL ref means "the previous word", with an implicit zero
+ * before the first one. Returns the packed length in words.
+ */
+size_t xor_rle_encode(const uint32_t* cur, const uint32_t* ref, size_t n, uint32_t* out)
+{
+  size_t len = 0;
+  size_t i = 0;
+  while (i < n)
+  {
+    uint32_t run = 0;
+    while (i < n && (cur[i] ^ (ref ? ref[i] : (i ? cur[i-1] : 0))) == 0)
+    {
+      run++;
+      i++;
+    }
+
+    size_t count_at = len + 1;
+    out[len++] = run;
+    out[len++] = 0;
+
+    while (i < n && (cur[i] ^ (ref ? ref[i] : (i ? cur[i-1] : 0))) != 0)
+    {
+      out[len++] = cur[i] ^ (ref ? ref[i] : (i ? cur[i-1] : 0));
+      out[count_at]++;
+      i++;
+    }
+  }
+  return len;
+}
+
+/**
+ * Inverse of xor_rle_encode. cur and ref may alias for in-place deltas.
+ */
+void xor_rle_decode(uint32_t* cur, const uint32_t* ref, size_t n, const uint32_t* in, size_t len)
+{
+  size_t i = 0;
+  size_t pos = 0;
+  while (pos < len && i < n)
+  {
+    uint32_t run = in[pos++];
+    uint32_t count = in[pos++];
+
+    for (uint32_t k = 0; k < run && i < n; k++, i++)
+    {
+      cur[i] = ref ? ref[i] : (i ? cur[i-1] : 0);
+    }
+    for (uint32_t k = 0; k < count && i < n; k++, i++)
+    {
+      cur[i] = in[pos++] ^ (ref ? ref[i] : (i ? cur[i-1] : 0));
+    }
+  }
+}
+
+/**
+ * xor_rle_encode against ref, reading only the TILE_SIZE tiles flagged in
+ * dirty (the rest must already equal ref), and bring those tiles of ref up
+ * to date. Same output as a full encode.
+ */
+size_t xor_rle_encode_dirty(const uint32_t* cur, uint32_t* ref, Env* env, const unsigned char* dirty, uint32_t* out)
+{
+  size_t len = 0;
+  size_t count_at = 0;
+  uint32_t run = 0;
+  bool literal = false;
+
+  for (int r = 0; r < env->height; r++)
+  {
+    const unsigned char* dirty_row = &dirty[(r / TILE_SIZE) * env->tiles_x];
+    for (int tx = 0; tx < env->tiles_x; tx++)
+    {
+      int c0 = tx*TILE_SIZE;
+      int c1 = c0 + TILE_SIZE > env->width ? env->width : c0 + TILE_SIZE;
+      if (!dirty_row[tx])
+      {
+        run = literal ? 0 : run;
+        literal = false;
+        run += c1 - c0;
+        continue;
+      }
+
+      for (int i = r*env->width + c0; i < r*env->width + c1; i++)
+      {
+        uint32_t x = cur[i] ^ ref[i];
+        if (x == 0)
+        {
+          run = literal ? 0 : run;
+          literal = false;
+          run++;
+          continue;
+        }
+        if (!literal)
+        {
+          out[len++] = run;
+          count_at = len;
+          out[len++] = 0;
+          literal = true;
+        }
+        out[len++] = x;
+        out[count_at]++;
+        ref[i] = cur[i];
+      }
+    }
+  }
+  if (!literal)
+  {
+    out[len++] = run;
+    out[len++] = 0;
+  }
+  return len;
+}
+
+void record_state(Recorder* recorder, Env* env)
+{
+  int32_t counters[2] = {env->tick, env->settle_pass};
+  fwrite(counters, sizeof(int32_t), 2, recorder->file);
+  fwrite(env->agents, sizeof(Agent), env->num_agents, recorder->file);
+}
+
+/**
+ * Bytes of packed wake flags in a frame
+ */
+size_t rec_wake_size(Env* env)
+{
+  return (env->tiles_x*env->tiles_y + 7) / 8;
+}
+
+void record_wake_flags(Recorder* recorder, Env* env)
+{
+  int tiles = env->tiles_x*env->tiles_y;
+  for (int t = 0; t < tiles; t += 8)
+  {
+    unsigned char bits = 0;
+    for (int k = 0; k < 8 && t + k < tiles; k++)
+    {
+      bits |= (env->tile_awake[t+k] != 0) << k;
+    }
+    fwrite(&bits, 1, 1, recorder->file);
+  }
+}
+
+void record_frame(Recorder* recorder, Env* env, bool keyframe)
+{
+  size_t n = env->width * env->height;
+  unsigned char tag = keyframe ? REC_KEYFRAME : REC_DELTA;
+  int32_t step = recorder->steps;
+
+  fwrite(&tag, 1, 1, recorder->file);
+  fwrite(&step, sizeof(step), 1, recorder->file);
+  if (keyframe)
+  {
+    record_state(recorder, env);
+  }
+  record_wake_flags(recorder, env);
+
+  // Soil only changes where heights do, so the same dirty tiles cover it
+  for (int m = 0; m < REC_MAPS; m++)
+  {
+    const uint32_t* cur = rec_map(env, m);
+    uint32_t* prev = recorder->prev_frame + m*n;
+    uint32_t len;
+    if (keyframe)
+    {
+      len = xor_rle_encode(cur, NULL, n, recorder->scratch);
+      memcpy(prev, cur, n * sizeof(uint32_t));
+    }
+    else
+    {
+      len = xor_rle_encode_dirty(cur, prev, env, env->tile_dirty, recorder->scratch);
+    }
+    fwrite(&len, sizeof(len), 1, recorder->file);
+    fwrite(recorder->scratch, sizeof(uint32_t), len, recorder->file);
+  }
+  memset(env->tile_dirty, 0, env->tiles_x*env->tiles_y);
+
+  recorder->frames = keyframe ? 0 : recorder->frames + 1;
+}
+
+/**
+ * Start recording env to path. Attaches the recorder to env so step() and
+ * reset() feed it; reset the env afterwards to write the first keyframe.
+ */
+Recorder* open_recorder(Env* env, const char* path)
+{
+  FILE* file = fopen(path, "wb");
+  if (!file)
+  {
+    printf("Could not open recording: %s\n", path);
+    return NULL;
+  }
+  // Big buffer so per-step records don't hit the disk individually
+  setvbuf(file, NULL, _IOFBF, 1 << 20);
+
+  Recorder* recorder = (Recorder*)calloc(1, sizeof(Recorder));
+  recorder->file = file;
+
+  RecHeader* header = &recorder->header;
+  header->magic = REC_MAGIC;
+  header->version = REC_VERSION;
+  header->width = env->width;
+  header->height = env->height;
+  header->num_agents = env->num_agents;
+  header->frame_interval = REC_FRAME_INTERVAL;
+  header->keyframe_interval = REC_KEYFRAME_INTERVAL;
+  header->agent_size = sizeof(Agent);
+  header->erosion_solver = env->erosion_solver;
+  header->settle_sweeps = env->settle_sweeps;
+  header->coarse_factor = env->coarse_factor;
+  header->soil_layers = REC_SOIL_LAYERS;
+  fwrite(header, sizeof(RecHeader), 1, file);
+
+  size_t n = env->width * env->height;
+  recorder->prev_frame = (uint32_t*)calloc(REC_MAPS * n, sizeof(uint32_t));
+  // Worst case is alternating zero/literal words: 3 words per 2 cells
+  recorder->scratch = (uint32_t*)calloc(2*n + 4, sizeof(uint32_t));
+
+  env->recorder = recorder;
+  return recorder;
+}
+
+void close_recorder(Recorder* recorder, Env* env)
+{
+  if (env->recorder == recorder)
+  {
+    env->recorder = NULL;
+  }
+  fclose(recorder->file);
+  free(recorder->prev_frame);
+  free(recorder->scratch);
+  free(recorder);
+}
+
+void record_reset(Recorder* recorder, Env* env, int seed)
+{
+  unsigned char tag = REC_RESET;
+  int32_t s = seed;
+  fwrite(&tag, 1, 1, recorder->file);
+  fwrite(&s, sizeof(s), 1, recorder->file);
+  record_frame(recorder, env, true);
+}
+
+void record_step(Recorder* recorder, Env* env)
+{
+  unsigned char tag = REC_STEP;
+  int32_t action = env->action;
+  fwrite(&tag, 1, 1, recorder->file);
+  fwrite(&action, sizeof(action), 1, recorder->file);
+  record_state(recorder, env);
+  recorder->steps += 1;
+
+  if (recorder->steps % recorder->header.frame_interval == 0)
+  {
+    record_frame(recorder, env, recorder->frames + 1 >= recorder->header.keyframe_interval);
+  }
+}
+
+// ---------------------------------------------------------------
+
+typedef struct RecFrame RecFrame;
+struct RecFrame
+{
+  long offset;  // file offset of the tag byte
+  long step;    // number of steps recorded before this frame
+  bool keyframe;
+  bool reset;   // reset keyframe after step 0, comes just before step+1
+};
+
+/**
+ * Replay order of a frame: the state after `step` steps, with a reset
+ * keyframe in between that and the next step
+ */
+long rec_frame_pos(const RecFrame* frame)
+{
+  return 2*frame->step + frame->reset;
+}
+
+typedef struct Replay Replay;
+struct Replay
+{
+  FILE* file;
+  RecHeader header;
+
+  long* step_offsets;  // file offset of each REC_STEP tag
+  long num_steps;
+  RecFrame* frames;
+  long num_frames;
+
+  long cursor;  // steps applied so far
+  long applied; // rec_frame_pos up to which frames are loaded into env
+  uint32_t* frame;  // REC_MAPS maps, as in Recorder::prev_frame
+  uint32_t* scratch;
+  size_t scratch_len;
+};
+
+void replay_read_state(Replay* replay, Env* env)
+{
+  int32_t counters[2];
+  fread(counters, sizeof(int32_t), 2, replay->file);
+  env->tick = counters[0];
+  env->settle_pass = counters[1];
+  fread(env->agents, sizeof(Agent), env->num_agents, replay->file);
+}
+
+/**
+ * Read the packed map payloads at the current file position into
+ * replay->frame, against itself for deltas, and copy them into env.
+ */
+void replay_read_frame(Replay* replay, Env* env, bool keyframe)
+{
+  size_t n = env->width * env->height;
+  for (int m = 0; m < REC_MAPS; m++)
+  {
+    uint32_t* frame = replay->frame + m*n;
+    uint32_t len;
+    fread(&len, sizeof(len), 1, replay->file);
+    if (len > replay->scratch_len)
+    {
+      replay->scratch = (uint32_t*)realloc(replay->scratch, len * sizeof(uint32_t));
+      replay->scratch_len = len;
+    }
+    fread(replay->scratch, sizeof(uint32_t), len, replay->file);
+    xor_rle_decode(frame, keyframe ? NULL : frame, n, replay->scratch, len);
+    memcpy(rec_map(env, m), frame, n * sizeof(uint32_t));
+  }
+  // Everything may differ from what the recorder last saw
+  memset(env->tile_dirty, 1, env->tiles_x*env->tiles_y);
+}
+
+void replay_read_wake_flags(Replay* replay, Env* env)
+{
+  int tiles = env->tiles_x*env->tiles_y;
+  for (int t = 0; t < tiles; t += 8)
+  {
+    unsigned char bits = 0;
+    fread(&bits, 1, 1, replay->file);
+    for (int k = 0; k < 8 && t + k < tiles; k++)
+    {
+      env->tile_awake[t+k] = (bits >> k) & 1;
+    }
+  }
+}
+
+/**
+ * Load the frame record starting at offset into env.
+ */
+void replay_load_frame(Replay* replay, Env* env, long offset)
+{
+  unsigned char tag;
+  int32_t step;
+  fseek(replay->file, offset, SEEK_SET);
+  fread(&tag, 1, 1, replay->file);
+  fread(&step, sizeof(step), 1, replay->file);
+  if (tag == REC_KEYFRAME)
+  {
+    replay_read_state(replay, env);
+  }
+  replay_read_wake_flags(replay, env);
+  replay_read_frame(replay, env, tag == REC_KEYFRAME);
+}
+
+/**
+ * Open a recording and index it. env must match the recorded dimensions,
+ * and takes on the recorded erosion settings.
+ */
+Replay* open_replay(Env* env, const char* path)
+{
+  FILE* file = fopen(path, "rb");
+  if (!file)
+  {
+    printf("Could not open replay: %s\n", path);
+    return NULL;
+  }
+
+  Replay* replay = (Replay*)calloc(1, sizeof(Replay));
+  replay->file = file;
+
+  RecHeader* header = &replay->header;
+  if (fread(header, sizeof(RecHeader), 1, file) != 1
+    || header->magic != REC_MAGIC
+    || header->version != REC_VERSION
+    || header->agent_size != sizeof(Agent))
+  {
+    printf("Not a compatible recording: %s\n", path);
+    fclose(file);
+    free(replay);
+    return NULL;
+  }
+  if (header->width != env->width || header->height != env->height
+    || header->num_agents != env->num_agents)
+  {
+    printf("Recording is %ix%i with %i agents, env is %ix%i with %i\n",
+      header->width, header->height, header->num_agents,
+      env->width, env->height, env->num_agents);
+    fclose(file);
+    free(replay);
+    return NULL;
+  }
+
+  if (header->soil_layers != REC_SOIL_LAYERS)
+  {
+    printf("Recording has soil layers %#x, this build has %#x\n", header->soil_layers, REC_SOIL_LAYERS);
+    fclose(file);
+    free(replay);
+    return NULL;
+  }
+  if (!valid_coarse_factor(header->coarse_factor))
+  {
+    printf("Recording has invalid coarse factor %i\n", header->coarse_factor);
+    fclose(file);
+    free(replay);
+    return NULL;
+  }
+
+  env->erosion_solver = header->erosion_solver;
+  env->settle_sweeps = header->settle_sweeps;
+  env->coarse_factor = header->coarse_factor;
+
+  // One pass to index steps and frames. A truncated tail is ignored.
+  long step_cap = 1024;
+  long frame_cap = 64;
+  replay->step_offsets = (long*)malloc(step_cap * sizeof(long));
+  replay->frames = (RecFrame*)malloc(frame_cap * sizeof(RecFrame));
+
+  size_t state_size = 2*sizeof(int32_t) + sizeof(Agent) * env->num_agents;
+  unsigned char tag;
+  bool after_reset = false;
+  long offset = ftell(file);
+  while (fread(&tag, 1, 1, file) == 1)
+  {
+    int32_t value;
+    uint32_t len;
+    if (fread(&value, sizeof(value), 1, file) != 1)
+    {
+      break;
+    }
+
+    if (tag == REC_RESET)
+    {
+      // Seed only, the keyframe follows as its own record
+      after_reset = true;
+    }
+    else if (tag == REC_STEP)
+    {
+      if (fseek(file, state_size, SEEK_CUR) != 0)
+      {
+        break;
+      }
+      if (replay->num_steps == step_cap)
+      {
+        step_cap *= 2;
+        replay->step_offsets = (long*)realloc(replay->step_offsets, step_cap * sizeof(long));
+      }
+      replay->step_offsets[replay->num_steps++] = offset;
+    }
+    else if (tag == REC_KEYFRAME || tag == REC_DELTA)
+    {
+      if (tag == REC_KEYFRAME && fseek(file, state_size, SEEK_CUR) != 0)
+      {
+        break;
+      }
+      if (fseek(file, rec_wake_size(env), SEEK_CUR) != 0)
+      {
+        break;
+      }
+      bool complete = true;
+      for (int m = 0; m < REC_MAPS && complete; m++)
+      {
+        complete = fread(&len, sizeof(len), 1, file) == 1
+          && fseek(file, len * sizeof(uint32_t), SEEK_CUR) == 0;
+      }
+      if (!complete)
+      {
+        break;
+      }
+      if (replay->num_frames == frame_cap)
+      {
+        frame_cap *= 2;
+        replay->frames = (RecFrame*)realloc(replay->frames, frame_cap * sizeof(RecFrame));
+      }
+      RecFrame* frame = &replay->frames[replay->num_frames++];
+      frame->offset = offset;
+      frame->step = value;
+      frame->keyframe = tag == REC_KEYFRAME;
+      frame->reset = after_reset && value > 0;
+      after_reset = false;
+    }
+    else
+    {
+      printf("Corrupt replay record %i at offset %li\n", tag, offset);
+      break;
+    }
+    offset = ftell(file);
+  }
+
+  replay->frame = (uint32_t*)calloc(REC_MAPS * env->width * env->height, sizeof(uint32_t));
+  replay->applied = -1;
+  return replay;
+}
+
+void close_replay(Replay* replay)
+{
+  fclose(replay->file);
+  free(replay->step_offsets);
+  free(replay->frames);
+  free(replay->frame);
+  free(replay->scratch);
+  free(replay);
+}
+
+/**
+ * Load the frames at replay order pos into env, unless they already are.
+ */
+void replay_apply_frames(Replay* replay, Env* env, long pos)
+{
+  if (pos <= replay->applied)
+  {
+    return;
+  }
+  replay->applied = pos;
+
+  // Frames are sorted by position, so a binary search finds ours if any
+  long lo = 0;
+  long hi = replay->num_frames;
+  while (lo < hi)
+  {
+    long mid = (lo + hi) / 2;
+    if (rec_frame_pos(&replay->frames[mid]) < pos)
+    {
+      lo = mid + 1;
+    }
+    else
+    {
+      hi = mid;
+    }
+  }
+  // Back-to-back resets share a position; load them in order so the last
+  // one wins
+  while (lo < replay->num_frames && rec_frame_pos(&replay->frames[lo]) == pos)
+  {
+    replay_load_frame(replay, env, replay->frames[lo].offset);
+    lo++;
+  }
+}
+
+/**
+ * Re-simulate the next recorded step. A reset keyframe between the two
+ * steps is loaded first, sim state is restored from the record afterwards,
+ * and a recorded frame is applied if one comes up. Returns false at the end
+ * of the recording.
+ */
+bool replay_step(Replay* replay, Env* env)
+{
+  if (replay->cursor >= replay->num_steps)
+  {
+    return false;
+  }
+
+  replay_apply_frames(replay, env, 2*replay->cursor + 1);
+
+  int32_t action;
+  fseek(replay->file, replay->step_offsets[replay->cursor] + 1, SEEK_SET);
+  fread(&action, sizeof(action), 1, replay->file);
+
+  Recorder* recorder = env->recorder;
+  env->recorder = NULL;
+  env->action = action;
+  step(env);
+  env->recorder = recorder;
+
+  replay_read_state(replay, env);
+  replay->cursor += 1;
+  replay_apply_frames(replay, env, 2*replay->cursor);
+  return true;
+}
+
+/**
+ * Jump to the state after `target` steps: load the nearest keyframe at or
+ * before it, roll deltas forward, then re-simulate the rest.
+ */
+void replay_seek(Replay* replay, Env* env, long target)
+{
+  if (target > replay->num_steps)
+  {
+    target = replay->num_steps;
+  }
+
+  // A reset keyframe at target comes after the state we want
+  long key = -1;
+  for (long i = 0; i < replay->num_frames && rec_frame_pos(&replay->frames[i]) <= 2*target; i++)
+  {
+    if (replay->frames[i].keyframe)
+    {
+      key = i;
+    }
+  }
+  if (key < 0)
+  {
+    printf("No keyframe before step %li\n", target);
+    return;
+  }
+
+  long last = key;
+  replay_load_frame(replay, env, replay->frames[key].offset);
+  for (long i = key + 1; i < replay->num_frames && rec_frame_pos(&replay->frames[i]) <= 2*target; i++)
+  {
+    if (replay->frames[i].keyframe)
+    {
+      break;
+    }
+    replay_load_frame(replay, env, replay->frames[i].offset);
+    last = i;
+  }
+
+  replay->cursor = replay->frames[last].step;
+  replay->applied = rec_frame_pos(&replay->frames[last]);
+  if (replay->cursor > 0 && !replay->frames[last].keyframe)
+  {
+    // Deltas don't carry sim state, take it from the step record
+    fseek(replay->file, replay->step_offsets[replay->cursor - 1] + 1 + sizeof(int32_t), SEEK_SET);
+    replay_read_state(replay, env);
+  }
+
+  while (replay->cursor < target)
+  {
+    replay_step(replay, env);
+  }
+}
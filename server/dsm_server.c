@@ -0,0 +1,220 @@
+/**
+ * Standalone env server. Hosts num_clients * envs_per_client room envs on a
+ * shared worker pool and exposes them through POSIX shared memory, see
+ * dsm_shm.h for the layout and dsm_client.h for the trainer side.
+ *
+ *   dsm_server --name /dsm_rl --clients 4 --envs-per-client 16 --workers 8
+ *
+ * Observations are the envs' height maps, which live in the segment itself,
+ * so nothing is copied between the simulation and the trainers.
+ */
+#include <signal.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "env_pool.h"
+#include "dsm_shm.h"
+
+static volatile sig_atomic_t interrupted = 0;
+
+// Finished steps ring the same doorbell as clients, so one futex wait
+// covers both
+void ring_doorbell(void* arg)
+{
+  ShmHeader* header = (ShmHeader*)arg;
+  atomic_fetch_add_explicit(&header->doorbell, 1, memory_order_release);
+  shm_futex_wake(&header->doorbell);
+}
+
+void on_signal(int sig)
+{
+  (void)sig;
+  interrupted = 1;
+}
+
+int main(int argc, char** argv)
+{
+  const char* name = "/dsm_rl";
+  int num_clients = 1;
+  int envs_per_client = 8;
+  int num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+
+  for (int i = 1; i + 1 < argc; i += 2)
+  {
+    if (strcmp(argv[i], "--name") == 0) name = argv[i+1];
+    else if (strcmp(argv[i], "--clients") == 0) num_clients = atoi(argv[i+1]);
+    else if (strcmp(argv[i], "--envs-per-client") == 0) envs_per_client = atoi(argv[i+1]);
+    else if (strcmp(argv[i], "--workers") == 0) num_workers = atoi(argv[i+1]);
+    else
+    {
+      printf("Unknown option: %s\n", argv[i]);
+      return 1;
+    }
+  }
+  if (num_clients < 1 || envs_per_client < 1 || num_workers < 1)
+  {
+    printf("Need at least one client, env and worker\n");
+    return 1;
+  }
+
+  int num_envs = num_clients * envs_per_client;
+  EnvPool* pool = create_env_pool(num_envs, num_workers);
+  Env* first = pool->envs[0];
+
+  ShmHeader layout = {0};
+  shm_layout(&layout, num_clients, envs_per_client, first->width, first->height);
+
+  shm_unlink(name);
+  int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd < 0 || ftruncate(fd, layout.size) != 0)
+  {
+    printf("Could not create shared memory segment %s\n", name);
+    free_env_pool(pool);
+    return 1;
+  }
+  ShmHeader* header = (ShmHeader*)mmap(NULL, layout.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (header == MAP_FAILED)
+  {
+    printf("Could not map shared memory segment %s\n", name);
+    shm_unlink(name);
+    free_env_pool(pool);
+    return 1;
+  }
+
+  memcpy(header, &layout, offsetof(ShmHeader, doorbell));
+  atomic_init(&header->doorbell, 0);
+  atomic_init(&header->shutdown, 0);
+  shm_init_rings(header);
+
+  // Workers are idle until the first send, so the height maps can move
+  // into the segment now
+  for (int i = 0; i < num_envs; i++)
+  {
+    Env* env = pool->envs[i];
+    free(env->height_map);
+    env->height_map = shm_obs(header, i);
+  }
+  pool->on_result = ring_doorbell;
+  pool->on_result_arg = header;
+  pool_reset(pool);
+
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+  printf("Serving %i envs (%i clients x %i) on %s with %i workers\n",
+    num_envs, num_clients, envs_per_client, name, pool->num_workers);
+
+  // Resolved from our own layout once; clients can scribble on the segment
+  ShmRingView* actions = (ShmRingView*)malloc(num_clients * sizeof(ShmRingView));
+  ShmRingView* results = (ShmRingView*)malloc(num_clients * sizeof(ShmRingView));
+  for (int c = 0; c < num_clients; c++)
+  {
+    actions[c] = shm_ring_view(header, &layout, c, false);
+    results[c] = shm_ring_view(header, &layout, c, true);
+  }
+  bool* cut_off = (bool*)calloc(num_clients, sizeof(bool));
+  float* rewards = shm_rewards(header);
+  unsigned char* dones = shm_dones(header);
+  int* ids = (int*)malloc(num_envs * sizeof(int));
+  bool* woken = (bool*)calloc(num_clients, sizeof(bool));
+  bool* pending = (bool*)calloc(num_envs, sizeof(bool));
+  int in_flight = 0;
+
+  while (!interrupted)
+  {
+    uint32_t bell = atomic_load_explicit(&header->doorbell, memory_order_acquire);
+    bool busy = false;
+
+    for (int c = 0; c < num_clients; c++)
+    {
+      ShmEntry entry;
+      while (!cut_off[c] && shm_ring_pop(&actions[c], &entry))
+      {
+        busy = true;
+        // Clients are untrusted: drop entries that would index another
+        // client's env, decode to nothing, or double-send an env
+        if (entry.env < 0 || entry.env >= envs_per_client
+          || entry.action < POOL_RESET || entry.action > CONTINUE)
+        {
+          printf("Client %i: dropping bad entry (env %i, action %i)\n", c, entry.env, entry.action);
+          continue;
+        }
+        int env_idx = c * envs_per_client + entry.env;
+        if (pending[env_idx])
+        {
+          printf("Client %i: dropping entry for env %i, already in flight\n", c, entry.env);
+          continue;
+        }
+        pending[env_idx] = true;
+        pool_send(pool, &env_idx, &entry.action, 1);
+        in_flight++;
+      }
+    }
+
+    int count = pool_poll(pool, ids, num_envs);
+    for (int i = 0; i < count; i++)
+    {
+      int env_idx = ids[i];
+      int c = env_idx / envs_per_client;
+      pending[env_idx] = false;
+      // No reward is defined for the room env yet
+      rewards[env_idx] = 0;
+      dones[env_idx] = pool->dones[env_idx];
+      ShmEntry entry = {env_idx - c * envs_per_client, 0};
+      // Only fails if the client broke the ring: it has at most
+      // envs_per_client entries in flight
+      if (!cut_off[c] && shm_ring_push(&results[c], entry))
+      {
+        woken[c] = true;
+      }
+    }
+    for (int c = 0; c < num_clients; c++)
+    {
+      if (woken[c])
+      {
+        shm_futex_wake(&results[c].ring->tail);
+        woken[c] = false;
+      }
+      if (!cut_off[c] && (actions[c].broken || results[c].broken))
+      {
+        printf("Client %i: ring counters out of range, no longer serving it\n", c);
+        cut_off[c] = true;
+      }
+    }
+    in_flight -= count;
+    busy = busy || count > 0;
+
+    if (!busy)
+    {
+      // Sleep until a client sends or a worker finishes. The timeout only
+      // exists to notice signals.
+      shm_futex_wait(&header->doorbell, bell, 100000);
+    }
+  }
+
+  atomic_store(&header->shutdown, 1);
+  for (int c = 0; c < num_clients; c++)
+  {
+    shm_futex_wake(&results[c].ring->tail);
+  }
+
+  // Let in-flight steps land before the height maps go away
+  while (in_flight > 0)
+  {
+    in_flight -= pool_recv(pool, ids, in_flight);
+  }
+  for (int i = 0; i < num_envs; i++)
+  {
+    pool->envs[i]->height_map = NULL;
+  }
+  free_env_pool(pool);
+  munmap(header, layout.size);
+  shm_unlink(name);
+  free(ids);
+  free(woken);
+  free(pending);
+  free(actions);
+  free(results);
+  free(cut_off);
+  return 0;
+}
@@ -1,4 +1,6 @@
+#include <string.h>
 #include "dsm.h"
+#include "raster.h"
 
 unsigned int actions[36] = {
     SPEED_UP, SPEED_UP, SPEED_UP, SPEED_UP, SPEED_UP, SPEED_UP,
@@ -10,7 +12,57 @@ unsigned int actions[36] = {
 };
 
 
-int main() {
+/**
+ * Play a recording back, either in the window or headless as fast as
+ * possible. LEFT/RIGHT seek 100 steps, P pauses. Headless playback writes
+ * every step as a PPM frame into frames_dir when given.
+ */
+int run_replay(const char* path, bool headless, const char* frames_dir, int render_cell_size) {
+    Env* env = alloc_room_env();
+    reset_room(env);
+
+    Replay* replay = open_replay(env, path);
+    if (!replay) {
+        free_allocated_grid(env);
+        return 1;
+    }
+    replay_seek(replay, env, 0);
+
+    if (headless) {
+        Raster* raster = frames_dir ? create_raster(env->width, env->height, env->width, env->height) : NULL;
+        while (replay_step(replay, env)) {
+            if (raster) {
+                char frame_path[1024];
+                snprintf(frame_path, sizeof(frame_path), "%s/frame_%06li.ppm", frames_dir, replay->cursor);
+                render_raster(raster, env);
+                write_ppm(frame_path, raster->rgb, raster->width, raster->height);
+            }
+        }
+        if (raster) free_raster(raster);
+        height_stats(env);
+        printf("Replayed %li steps, %li frames. Final mean height: %f, max: %f\n",
+            replay->num_steps, replay->num_frames, env->mean, env->max);
+        close_replay(replay);
+        free_allocated_grid(env);
+        return 0;
+    }
+
+    Renderer* renderer = init_renderer(render_cell_size, env->width, env->height);
+    bool paused = false;
+    while (!WindowShouldClose()) {
+        if (IsKeyPressed(KEY_P)) paused = !paused;
+        if (IsKeyPressed(KEY_RIGHT)) replay_seek(replay, env, replay->cursor + 100);
+        if (IsKeyPressed(KEY_LEFT)) replay_seek(replay, env, replay->cursor > 100 ? replay->cursor - 100 : 0);
+        if (!paused) replay_step(replay, env);
+        render_global(renderer, env);
+    }
+    close_renderer(renderer);
+    close_replay(replay);
+    free_allocated_grid(env);
+    return 0;
+}
+
+int main(int argc, char** argv) {
     int width = 500;
     int height = 500;
     int num_agents = 1;
@@ -22,7 +74,40 @@ int main() {
     int render_cell_size = 4;
     int seed = 42;
 
+    const char* record_path = NULL;
+    const char* replay_path = NULL;
+    const char* frames_dir = NULL;
+    bool headless = false;
+    int erosion_solver = SOLVER_STEEPEST;
+    int settle_sweeps = 1;
+    int coarse_factor = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) record_path = argv[++i];
+        else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) replay_path = argv[++i];
+        else if (strcmp(argv[i], "--headless") == 0) headless = true;
+        else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) frames_dir = argv[++i];
+        else if (strcmp(argv[i], "--multiflow") == 0) erosion_solver = SOLVER_MULTIFLOW;
+        else if (strcmp(argv[i], "--sweeps") == 0 && i + 1 < argc) settle_sweeps = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--coarse") == 0 && i + 1 < argc) coarse_factor = atoi(argv[++i]);
+    }
+
+    if (!valid_coarse_factor(coarse_factor)) {
+        printf("--coarse must be 0 or a power of two up to %i\n", TILE_SIZE);
+        return 1;
+    }
+
+    if (replay_path) {
+        return run_replay(replay_path, headless, frames_dir, render_cell_size);
+    }
+
     Env* env = alloc_room_env();
+    env->erosion_solver = erosion_solver;
+    env->settle_sweeps = settle_sweeps;
+    env->coarse_factor = coarse_factor;
+    Recorder* recorder = NULL;
+    if (record_path) {
+        recorder = open_recorder(env, record_path);
+    }
     reset_room(env);
  
     Renderer* renderer = init_renderer(render_cell_size, width, height);
@@ -54,6 +139,7 @@ int main() {
 
     }
     close_renderer(renderer);
+    if (recorder) close_recorder(recorder, env);
     free_allocated_grid(env);
     return 0;
 }